@@ -0,0 +1,108 @@
+/*
+    Fade curve check for the square fade patch
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Compare the gains of fade -r (recurrences) and fade -a (tables) with
+	the closed form fade_gain(), for every fade type and shape, fading in
+	and out, from the first index and from the middle of the fade, on
+	short fades, fades around the restart period of the recurrences and
+	long fades. Every index is checked, so every restart is.
+	It includes the patched fade.c, build it in the SoX src directory:
+	cc -O2 -I. -o fade-test path/to/fade-test.c -L.libs -lsox -lm
+	Prints the largest errors and exits with 1 if one is over its bound.
+*/
+
+#include "fade.c"
+
+#define RECURRENCE_ERROR 1e-8	/* Bound of fade -r, as documented */
+#define ACCURACY 1e-6			/* fade -a accuracy checked */
+#define ROUNDING 1e-12			/* The parabolas reach ACCURACY, plus rounding */
+
+static const uint64_t ranges[] = {
+	1, 2, 3, 5,				/* Shorter than a restart period */
+	FADE_RESTART - 1, FADE_RESTART, FADE_RESTART + 1,
+	2 * FADE_RESTART - 1, 2 * FADE_RESTART, 2 * FADE_RESTART + 1,
+	1000, 44100, 30 * 44100	/* Up to a 30 s fade */
+};
+
+typedef struct {
+	int type;
+	double shape;
+} curve_t;
+
+static const curve_t curves[] = {
+	{FADE_QUARTER, 0}, {FADE_HALF, 0}, {FADE_TRI, 0}, {FADE_LOG, 0},
+	{FADE_PAR, 0}, {FADE_SQUARE, 0},
+	{FADE_POWER, 1}, {FADE_POWER, 2}, {FADE_POWER, 3}, {FADE_POWER, 4},
+	{FADE_EXP, 0.5}, {FADE_EXP, 1}, {FADE_EXP, 5}, {FADE_EXP, 10}, {FADE_EXP, 20},
+	{FADE_CUBIC, 0}
+};
+
+/*
+	Largest error of the gains of c from index first to the end of the fade,
+	taken as fade_run() takes them: upwards fading in, downwards fading out
+*/
+static double curve_error(fade_curve_t *c, uint64_t first, int step)
+{
+	double error, worst = 0;
+	uint64_t index, n;
+
+	for (n = first; n < c->range; n++) {
+		index = step > 0 ? n : c->range - n;
+		error = fabs(curve_gain(c, index) - fade_gain(index, c->range, c->type, c->shape));
+		if (error > worst) worst = error;
+	}
+	return worst;
+}
+
+int main(void)
+{
+	size_t i, r;
+	int step, failed = 0;
+	double recurrence, table, error;
+	fade_curve_t c;
+
+	for (i = 0; i < sizeof(curves) / sizeof(curves[0]); i++) {
+		recurrence = table = 0;
+		for (r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++)
+			for (step = -1; step <= 1; step += 2) {
+				memset(&c, 0, sizeof(c));
+				c.type = curves[i].type;
+				c.shape = curves[i].shape;
+				c.range = ranges[r];
+
+				fade_recurrence(&c, step);
+				error = curve_error(&c, 0, step);
+				recurrence = error > recurrence ? error : recurrence;
+				/* Started again in the middle, as after a skip */
+				fade_recurrence(&c, step);
+				error = curve_error(&c, c.range / 3, step);
+				recurrence = error > recurrence ? error : recurrence;
+
+				fade_table(&c, fade_points(&c, ACCURACY));
+				error = curve_error(&c, 0, step);
+				table = error > table ? error : table;
+				free(c.table);
+			}
+		printf("%c %g: recurrence %.2e, table %.2e\n", curves[i].type, curves[i].shape, recurrence, table);
+		if (recurrence > RECURRENCE_ERROR || table > ACCURACY + ROUNDING) failed = 1;
+	}
+	if (failed) printf("Gain errors over the bounds\n");
+
+	return failed;
+}
@@ -0,0 +1,653 @@
+/*
+    Batch limiter
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Limit many files in one process. The list has a line for each file,
+	input and output separated by a tab (paste inputs outputs > list).
+	The main thread keeps up to K files in flight, reading and writing them
+	whole with io_uring (or pread and pwrite if the kernel doesn't have it).
+	A fixed pool of worker threads runs the limiter core, each worker keeps
+	its limiter and resets it between files, so the lookahead buffer is
+	set up once per worker and not once per file.
+	Each output is written to output.tmp and renamed when it is complete,
+	so a file can be limited in place.
+	Usage: limiter-batch [-l max-lookahead (s)] [-k files] [-n workers] [-v]
+		[-r rate -b bits [-f]] list threshold (dB)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "limiter.h"
+#include "limiter-wav.h"
+
+#define DEFAULT_FILES 16		/* Files in flight */
+#define BLOCK_FRAMES 4096		/* Frames offered to each limiter_process() call */
+#define MAX_IO (1U << 30)		/* Bytes read or written by a single operation */
+#define EVENT_TAG 1				/* user_data of the eventfd read, jobs are aligned pointers */
+
+/* Minimal io_uring, without liburing */
+typedef struct {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail, *sq_head, sq_mask;
+	unsigned *cq_tail, *cq_head, cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned tail;			/* Submission tail, published at the next enter */
+	unsigned to_submit;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+} uring_t;
+
+enum {
+	JOB_READING,
+	JOB_LIMITING,
+	JOB_WRITING
+};
+
+typedef struct job {
+	char *input_name;
+	char *output_name;
+	char *temporary_name;	/* The output is written here and renamed when complete */
+	int in_fd, out_fd;
+	int stage;
+	uint8_t *input;
+	size_t input_size;
+	uint8_t *output;
+	size_t output_size;
+	size_t done;			/* Bytes read or written so far */
+	size_t frames;
+	unsigned int rate;
+	const char *error;		/* NULL if all is well */
+	double start, limit_time;
+	struct job *next;
+} job_t;
+
+typedef struct {
+	limiter_config_t config;
+	audio_format_t raw;		/* Format of RAW files, rate 0 if not given */
+	uring_t ring;
+	int use_uring;
+	int event_fd;
+	uint64_t event_value;	/* Buffer of the eventfd read */
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;
+	job_t *ready;			/* Read, waiting for a worker */
+	job_t *ready_last;
+	job_t *limited;			/* Limited, waiting to be written */
+	int quit;
+	unsigned int in_flight;
+	/* Totals */
+	unsigned int files, errors;
+	uint64_t frames, bytes;
+	double audio_seconds, limit_time;
+} batch_t;
+
+static const char *usage = "Usage: %s [-l max-lookahead (s)] [-k files] [-n workers] [-v]"
+	" [-r rate -b bits [-f]] list threshold (dB)\n";
+static int verbose = 0;
+
+static int uring_init(uring_t *ring, const unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned i, *array;
+
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(uring_t));
+	if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) return -1;
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) goto fail;
+	}
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto fail;
+
+	ring->sq_head = (unsigned *)((uint8_t *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((uint8_t *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)((uint8_t *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->cq_head = (unsigned *)((uint8_t *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((uint8_t *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)((uint8_t *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ring + p.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+
+	/* Submission entries are always used in order */
+	array = (unsigned *)((uint8_t *)ring->sq_ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; ++i) array[i] = i;
+
+	return 0;
+
+fail:
+	close(ring->fd);
+	return -1;
+}
+
+/* Returns NULL if the submission queue is full */
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) return NULL;
+	sqe = &ring->sqes[ring->tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	++ring->tail;
+	++ring->to_submit;
+	return sqe;
+}
+
+/*
+	Submit the queued operations and wait for a completion
+	Returns -1 on error
+*/
+static int uring_wait(uring_t *ring, uint64_t *user_data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int ret, empty;
+
+	for (;;) {
+		head = *ring->cq_head;
+		empty = head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (!empty && ring->to_submit == 0) {
+			cqe = &ring->cqes[head & ring->cq_mask];
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, empty ? 1 : 0,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		ring->to_submit -= ret;
+	}
+}
+
+static void uring_prepare(struct io_uring_sqe *sqe, const int opcode, const int fd,
+	void *data, const size_t size, const uint64_t offset, const uint64_t user_data)
+{
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = size < MAX_IO ? size : MAX_IO;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void message(int level, const char *text, void *data)
+{
+	(void)data;
+	if (level == LIMITER_MESSAGE_DEBUG && !verbose) return;
+	fprintf(stderr, "%s\n", text);
+}
+
+/*
+	Limit a whole file from job->input to job->output, the limiter
+	is created for the first file and when the rate changes
+*/
+static void limit_job(batch_t *b, job_t *job, limiter_t **l, limiter_config_t *config)
+{
+	audio_format_t format = b->raw;
+	limiter_config_t wanted = *config;
+	const char *error;
+	size_t header_size, frame_size, consumed, produced, iframes, oframes;
+	double start = now();
+
+	if (parse_wav(job->input, job->input_size, &format) < 0) {
+		if (job->input_size >= 4 && !memcmp(job->input, "RIFF", 4)) {
+			job->error = "not a PCM WAV file";
+			return;
+		}
+		if (b->raw.rate == 0) {
+			job->error = "not a PCM WAV file, give -r and -b for RAW input";
+			return;
+		}
+		format = b->raw;
+		format.data_offset = 0;
+		format.data_size = job->input_size;
+	}
+	if (sample_format(&format, &wanted.format) < 0) {
+		job->error = "sample format not supported";
+		return;
+	}
+	wanted.rate = format.rate;
+	wanted.channels = format.channels;
+	if ((error = limiter_config_check(&wanted))) {
+		job->error = error;
+		return;
+	}
+	if (*l && wanted.rate == config->rate && wanted.channels == config->channels && wanted.format == config->format)
+		/* Same stream format, recycle the limiter and its lookahead buffer */
+		limiter_reset(*l);
+	else {
+		limiter_destroy(*l);
+		*config = wanted;
+		if (!(*l = limiter_create(config))) {
+			job->error = "cannot start the limiter";
+			return;
+		}
+	}
+
+	frame_size = format.channels * format.bits / 8;
+	job->frames = format.data_size / frame_size;
+	job->rate = format.rate;
+	format.data_size = job->frames * frame_size;
+	header_size = format.wav ? WAV_HEADER_SIZE : 0;
+	if (format.wav && format.data_size > UINT32_MAX - WAV_HEADER_SIZE) {
+		job->error = "too big for a WAV file";
+		return;
+	}
+	job->output_size = header_size + format.data_size;
+	if (!(job->output = malloc(job->output_size > 0 ? job->output_size : 1))) {
+		job->error = "cannot allocate the output";
+		return;
+	}
+
+	consumed = produced = 0;
+	while (consumed < job->frames) {
+		iframes = job->frames - consumed < BLOCK_FRAMES ? job->frames - consumed : BLOCK_FRAMES;
+		oframes = job->frames - produced;
+		limiter_process(*l, job->input + format.data_offset + consumed * frame_size, &iframes,
+			job->output + header_size + produced * frame_size, &oframes);
+		consumed += iframes;
+		produced += oframes;
+	}
+	while (produced < job->frames) {
+		oframes = job->frames - produced;
+		if (limiter_flush(*l, job->output + header_size + produced * frame_size, &oframes) < 0 || oframes == 0) break;
+		produced += oframes;
+	}
+	if (produced < job->frames) job->error = "limiter failed";
+	if (format.wav) write_wav_header(job->output, &format);
+	job->limit_time = now() - start;
+}
+
+static void *worker(void *data)
+{
+	batch_t *b = (batch_t *) data;
+	limiter_config_t config = b->config;
+	limiter_t *l = NULL;
+	job_t *job;
+	const uint64_t one = 1;
+
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		while (!b->ready && !b->quit) pthread_cond_wait(&b->ready_cond, &b->lock);
+		if (!b->ready) {
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		job = b->ready;
+		b->ready = job->next;
+		pthread_mutex_unlock(&b->lock);
+
+		limit_job(b, job, &l, &config);
+
+		pthread_mutex_lock(&b->lock);
+		job->next = b->limited;
+		b->limited = job;
+		pthread_mutex_unlock(&b->lock);
+		/* Wake up the main thread */
+		if (write(b->event_fd, &one, sizeof(one)) < 0) perror("eventfd");
+	}
+	limiter_destroy(l);
+	return NULL;
+}
+
+static void finish_job(batch_t *b, job_t *job)
+{
+	const double elapsed = now() - job->start;
+	const double seconds = job->rate ? (double)job->frames / job->rate : 0;
+
+	if (job->in_fd >= 0) close(job->in_fd);
+	if (job->out_fd >= 0) {
+		if (close(job->out_fd) < 0 && !job->error) job->error = strerror(errno);
+		if (!job->error && rename(job->temporary_name, job->output_name) < 0) job->error = strerror(errno);
+		if (job->error) unlink(job->temporary_name);
+	}
+
+	++b->files;
+	if (job->error) {
+		++b->errors;
+		printf("%s: %s\n", job->input_name, job->error);
+	} else {
+		b->frames += job->frames;
+		b->bytes += job->input_size;
+		b->audio_seconds += seconds;
+		b->limit_time += job->limit_time;
+		printf("%s: %lu frames, %.3f ms limiting, %.3f ms in total, %.0fx realtime\n", job->input_name,
+			(unsigned long)job->frames, job->limit_time * 1000, elapsed * 1000,
+			job->limit_time > 0 ? seconds / job->limit_time : 0);
+	}
+
+	--b->in_flight;
+	free(job->input);
+	free(job->output);
+	free(job->input_name);
+	free(job->temporary_name);
+	free(job);
+}
+
+static void queue_job(batch_t *b, job_t *job)
+{
+	job->stage = JOB_LIMITING;
+	job->next = NULL;
+	pthread_mutex_lock(&b->lock);
+	if (b->ready) b->ready_last->next = job;
+	else b->ready = job;
+	b->ready_last = job;
+	pthread_cond_signal(&b->ready_cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/*
+	Read or write the rest of the job buffer, asynchronously with io_uring,
+	synchronously otherwise, in that case the completion is handled here
+*/
+static void submit_io(batch_t *b, job_t *job);
+
+static void io_done(batch_t *b, job_t *job, const int res)
+{
+	const size_t size = job->stage == JOB_READING ? job->input_size : job->output_size;
+
+	if (res <= 0) {
+		job->error = res < 0 ? strerror(-res) : "unexpected end of file";
+		finish_job(b, job);
+		return;
+	}
+	job->done += res;
+	if (job->done < size) submit_io(b, job);
+	else if (job->stage == JOB_READING) queue_job(b, job);
+	else finish_job(b, job);
+}
+
+static void submit_io(batch_t *b, job_t *job)
+{
+	const int reading = job->stage == JOB_READING;
+	uint8_t *data = (reading ? job->input : job->output) + job->done;
+	const size_t size = (reading ? job->input_size : job->output_size) - job->done;
+	struct io_uring_sqe *sqe;
+	ssize_t res;
+
+	if (b->use_uring && (sqe = uring_get_sqe(&b->ring))) {
+		uring_prepare(sqe, reading ? IORING_OP_READ : IORING_OP_WRITE, reading ? job->in_fd : job->out_fd,
+			data, size, job->done, (uintptr_t)job);
+		return;
+	}
+	if (reading) res = pread(job->in_fd, data, size < MAX_IO ? size : MAX_IO, job->done);
+	else res = pwrite(job->out_fd, data, size < MAX_IO ? size : MAX_IO, job->done);
+	io_done(b, job, res < 0 ? -errno : (int)res);
+}
+
+/*
+	Open the files of a list line and start reading the input
+	Returns -1 at the end of the list
+*/
+static int start_job(batch_t *b, FILE *list)
+{
+	char *line = NULL, *tab;
+	size_t allocated = 0;
+	ssize_t length;
+	struct stat st, temporary_st;
+	job_t *job;
+
+	do {
+		if ((length = getline(&line, &allocated, list)) < 0) {
+			free(line);
+			return -1;
+		}
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = 0;
+	} while (length == 0);
+
+	if (!(job = calloc(1, sizeof(job_t)))) {
+		free(line);
+		return -1;
+	}
+	++b->in_flight;
+	job->input_name = line;
+	job->in_fd = job->out_fd = -1;
+	job->start = now();
+	job->stage = JOB_READING;
+	if (!(tab = strchr(line, '\t'))) {
+		job->error = "no output file name";
+		finish_job(b, job);
+		return 0;
+	}
+	*tab = 0;
+	job->output_name = tab + 1;
+
+	if ((job->in_fd = open(job->input_name, O_RDONLY)) < 0 || fstat(job->in_fd, &st) < 0) {
+		job->error = strerror(errno);
+		finish_job(b, job);
+		return 0;
+	}
+	/*
+		The output replaces its file only when it is complete, so the
+		input can be the output, but not the temporary file itself
+	*/
+	if (!(job->temporary_name = malloc(strlen(job->output_name) + 5))) {
+		job->error = "cannot allocate the output name";
+		finish_job(b, job);
+		return 0;
+	}
+	strcpy(job->temporary_name, job->output_name);
+	strcat(job->temporary_name, ".tmp");
+	if (stat(job->temporary_name, &temporary_st) == 0
+		&& temporary_st.st_dev == st.st_dev && temporary_st.st_ino == st.st_ino) {
+		job->error = "the temporary output file is the input";
+		finish_job(b, job);
+		return 0;
+	}
+	if ((job->out_fd = open(job->temporary_name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+		job->error = strerror(errno);
+		finish_job(b, job);
+		return 0;
+	}
+	job->input_size = st.st_size;
+	if (!(job->input = malloc(job->input_size > 0 ? job->input_size : 1))) {
+		job->error = "cannot allocate the input";
+		finish_job(b, job);
+		return 0;
+	}
+	if (job->input_size == 0) queue_job(b, job);
+	else submit_io(b, job);
+	return 0;
+}
+
+/* Write the limited files, or finish them if they failed */
+static void collect_limited(batch_t *b)
+{
+	job_t *job, *next;
+
+	pthread_mutex_lock(&b->lock);
+	job = b->limited;
+	b->limited = NULL;
+	pthread_mutex_unlock(&b->lock);
+
+	for (; job; job = next) {
+		next = job->next;
+		job->stage = JOB_WRITING;
+		job->done = 0;
+		if (job->error || job->output_size == 0) finish_job(b, job);
+		else submit_io(b, job);
+	}
+}
+
+static void submit_event_read(batch_t *b)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&b->ring);
+
+	if (sqe) uring_prepare(sqe, IORING_OP_READ, b->event_fd, &b->event_value, sizeof(b->event_value), 0, EVENT_TAG);
+}
+
+int main(int argc, char *argv[])
+{
+	batch_t b;
+	FILE *list;
+	pthread_t *threads;
+	unsigned int i, files = DEFAULT_FILES, workers;
+	int opt, more = 1, res;
+	uint64_t user_data;
+	const char *error;
+	double start, elapsed;
+
+	memset(&b, 0, sizeof(b));
+	limiter_config_init(&b.config);
+	b.config.message = message;
+	b.raw.channels = 2;
+	workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+	while ((opt = getopt(argc, argv, "+l:k:n:vr:b:f")) != -1) switch (opt) {
+		case 'l':
+			if (sscanf(optarg, "%f", &b.config.max_lookahead) != 1) {
+				fprintf(stderr, usage, argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'k':
+			files = atoi(optarg);
+			break;
+		case 'n':
+			workers = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'r':
+			b.raw.rate = atoi(optarg);
+			break;
+		case 'b':
+			b.raw.bits = atoi(optarg);
+			break;
+		case 'f':
+			b.raw.is_float = 1;
+			break;
+		default:
+			fprintf(stderr, usage, argv[0]);
+			return EXIT_FAILURE;
+	}
+	if (optind + 2 != argc || sscanf(argv[optind + 1], "%f", &b.config.threshold_db) != 1
+		|| files == 0 || workers == 0) {
+		fprintf(stderr, usage, argv[0]);
+		return EXIT_FAILURE;
+	}
+	if ((error = limiter_config_check(&b.config))) {
+		fprintf(stderr, "%s\n", error);
+		return EXIT_FAILURE;
+	}
+	if (!(list = !strcmp(argv[optind], "-") ? stdin : fopen(argv[optind], "r"))) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	/* An operation for each file in flight, plus the eventfd read */
+	b.use_uring = uring_init(&b.ring, 2 * files + 2) == 0;
+	if (!b.use_uring) fprintf(stderr, "io_uring not available, using pread and pwrite\n");
+	if ((b.event_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.ready_cond, NULL);
+	if (!(threads = malloc(workers * sizeof(pthread_t)))) return EXIT_FAILURE;
+	for (i = 0; i < workers; ++i)
+		if (pthread_create(&threads[i], NULL, worker, &b) != 0) {
+			fprintf(stderr, "Cannot start the workers\n");
+			return EXIT_FAILURE;
+		}
+
+	start = now();
+	if (b.use_uring) submit_event_read(&b);
+	for (;;) {
+		while (more && b.in_flight < files)
+			if (start_job(&b, list) < 0) more = 0;
+		if (b.in_flight == 0) break;
+
+		if (!b.use_uring) {
+			/* Reads and writes are done, wait for the workers */
+			if (read(b.event_fd, &b.event_value, sizeof(b.event_value)) < 0 && errno != EINTR) {
+				perror("eventfd");
+				break;
+			}
+			collect_limited(&b);
+			continue;
+		}
+		if (uring_wait(&b.ring, &user_data, &res) < 0) {
+			perror("io_uring");
+			break;
+		}
+		if (user_data == EVENT_TAG) {
+			collect_limited(&b);
+			submit_event_read(&b);
+		} else io_done(&b, (job_t *)(uintptr_t)user_data, res);
+	}
+	elapsed = now() - start;
+
+	pthread_mutex_lock(&b.lock);
+	b.quit = 1;
+	pthread_cond_broadcast(&b.ready_cond);
+	pthread_mutex_unlock(&b.lock);
+	for (i = 0; i < workers; ++i) pthread_join(threads[i], NULL);
+	free(threads);
+
+	printf("%u files, %u errors, %" PRIu64 " frames, %.3f s, %.1f MB/s, %.0fx realtime, %.0fx realtime per worker\n",
+		b.files, b.errors, b.frames, elapsed, elapsed > 0 ? b.bytes / elapsed / 1e6 : 0,
+		elapsed > 0 ? b.audio_seconds / elapsed : 0, b.limit_time > 0 ? b.audio_seconds / b.limit_time : 0);
+
+	if (list != stdin) fclose(list);
+	close(b.event_fd);
+	return b.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+/*
+    Limiter daemon
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Keep warm limiters and run jobs sent over a Unix socket, see
+	limiter-daemon.h for the protocol. Each of the -n workers owns a limiter,
+	created at startup for 44100 Hz and recreated only if a job has another
+	stream format, otherwise it is reset between jobs.
+	A worker serves a connection until the client closes it, up to -q
+	accepted connections wait for a worker. When they are all taken the
+	daemon stops accepting, so further clients wait in the listen backlog
+	and then in connect(): that is the backpressure.
+	Usage: limiter-daemon [-l max-lookahead (s)] [-n workers] [-q queue] [-v] socket
+*/
+
+#define _GNU_SOURCE /* accept4(), MSG_CMSG_CLOEXEC, F_GET_SEALS */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "limiter.h"
+#include "limiter-daemon.h"
+
+#define DEFAULT_WORKERS 4
+#define DEFAULT_QUEUE 16
+#define BLOCK_FRAMES 4096	/* Frames offered to each limiter_process() call */
+#define STOP_CHECK_MS 100	/* A full queue is waited for in steps of this, to see SIGINT and SIGTERM */
+
+typedef struct {
+	limiter_config_t config;	/* Defaults of every limiter */
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	int *queue;				/* Accepted connections waiting for a worker */
+	unsigned int queue_size, queue_start, queue_count;
+} daemon_t;
+
+static const char *usage = "Usage: %s [-l max-lookahead (s)] [-n workers] [-q queue] [-v] socket\n";
+static int verbose = 0;
+static volatile sig_atomic_t quit = 0;
+
+static void message(int level, const char *text, void *data)
+{
+	(void)data;
+	if (level == LIMITER_MESSAGE_DEBUG && !verbose) return;
+	fprintf(stderr, "%s\n", text);
+}
+
+static void stop(int signal)
+{
+	(void)signal;
+	quit = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t sample_size(const uint32_t format)
+{
+	switch (format) {
+		case LIMITER_FORMAT_S16: return 2;
+		case LIMITER_FORMAT_S24: return 3;
+		default: return 4;
+	}
+}
+
+/*
+	Limit the samples of a request in place: the output never passes
+	the input, so it is written where the input was already consumed.
+	The file must be sealed against shrinking: a client truncating it
+	while it is mapped would kill the daemon with SIGBUS.
+	Returns 0 or an errno value
+*/
+static int run_request(const limiter_request_t *request, const int fd, limiter_t **l,
+	limiter_config_t *config, limiter_response_t *response)
+{
+	limiter_config_t wanted = *config;
+	limiter_stats_t before, after;
+	struct stat st;
+	uint8_t *map, *samples;
+	size_t frame_size, map_size, consumed, produced, iframes, oframes;
+	int seals;
+
+	if (request->magic != LIMITER_DAEMON_MAGIC || request->version != LIMITER_DAEMON_VERSION || fd < 0)
+		return EPROTO;
+
+	wanted.rate = request->rate;
+	wanted.channels = request->channels;
+	wanted.format = request->format;
+	wanted.threshold_db = request->threshold_db;
+	if (limiter_config_check(&wanted)) return EINVAL;
+
+	if ((seals = fcntl(fd, F_GET_SEALS)) < 0 || !(seals & F_SEAL_SHRINK)) return EBADF;
+	frame_size = request->channels * sample_size(request->format);
+	if (fstat(fd, &st) < 0) return errno;
+	if (request->offset > (uint64_t)st.st_size || request->frames > ((uint64_t)st.st_size - request->offset) / frame_size)
+		return ERANGE;
+	map_size = request->offset + request->frames * frame_size;
+	if (map_size == 0) return 0;
+
+	if (*l && wanted.rate == config->rate && wanted.channels == config->channels && wanted.format == config->format) {
+		limiter_reset(*l);
+		limiter_set_threshold(*l, wanted.threshold_db);
+	} else {
+		limiter_destroy(*l);
+		*config = wanted;
+		if (!(*l = limiter_create(config))) return ENOMEM;
+	}
+
+	map = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, (off_t)0);
+	if (map == MAP_FAILED) return errno;
+	samples = map + request->offset;
+
+	limiter_get_stats(*l, &before);
+	consumed = produced = 0;
+	while (consumed < request->frames) {
+		iframes = request->frames - consumed < BLOCK_FRAMES ? request->frames - consumed : BLOCK_FRAMES;
+		oframes = request->frames - produced;
+		limiter_process(*l, samples + consumed * frame_size, &iframes, samples + produced * frame_size, &oframes);
+		consumed += iframes;
+		produced += oframes;
+	}
+	while (produced < request->frames) {
+		oframes = request->frames - produced;
+		if (limiter_flush(*l, samples + produced * frame_size, &oframes) < 0 || oframes == 0) break;
+		produced += oframes;
+	}
+	munmap(map, map_size);
+	limiter_get_stats(*l, &after);
+
+	response->frames = produced;
+	response->slices = after.slices - before.slices;
+	response->actions = after.actions - before.actions;
+
+	return produced == request->frames ? 0 : EIO;
+}
+
+/* Take the file descriptor passed with the request, -1 if none */
+static int received_fd(struct msghdr *message)
+{
+	struct cmsghdr *control;
+	int fd = -1, extra;
+	size_t i;
+
+	for (control = CMSG_FIRSTHDR(message); control; control = CMSG_NXTHDR(message, control)) {
+		if (control->cmsg_level != SOL_SOCKET || control->cmsg_type != SCM_RIGHTS) continue;
+		for (i = 0; i * sizeof(int) < control->cmsg_len - CMSG_LEN(0); ++i) {
+			memcpy(&extra, CMSG_DATA(control) + i * sizeof(int), sizeof(int));
+			/* Only the first one is used */
+			if (fd < 0) fd = extra;
+			else close(extra);
+		}
+	}
+	return fd;
+}
+
+static void serve(const int connection, limiter_t **l, limiter_config_t *config)
+{
+	limiter_request_t request;
+	limiter_response_t response;
+	struct msghdr message;
+	struct iovec iov;
+	union {
+		char buffer[CMSG_SPACE(sizeof(int) * 4)];
+		struct cmsghdr align;
+	} control_buffer;
+	ssize_t n;
+	int fd;
+	double start;
+
+	for (;;) {
+		memset(&message, 0, sizeof(message));
+		iov.iov_base = &request;
+		iov.iov_len = sizeof(request);
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control_buffer.buffer;
+		message.msg_controllen = sizeof(control_buffer.buffer);
+
+		if ((n = recvmsg(connection, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		fd = received_fd(&message);
+
+		start = now();
+		memset(&response, 0, sizeof(response));
+		if (n != sizeof(request) || (message.msg_flags & (MSG_TRUNC|MSG_CTRUNC))) response.error = EPROTO;
+		else response.error = run_request(&request, fd, l, config, &response);
+		if (fd >= 0) close(fd);
+		if (verbose)
+			fprintf(stderr, "%lu frames, %.3f ms, %s\n", (unsigned long)response.frames, (now() - start) * 1000,
+				response.error ? strerror(response.error) : "done");
+
+		if (send(connection, &response, sizeof(response), MSG_NOSIGNAL) != sizeof(response)) break;
+	}
+	close(connection);
+}
+
+static void *worker(void *data)
+{
+	daemon_t *d = (daemon_t *) data;
+	limiter_config_t config = d->config;
+	limiter_t *l;
+	int connection;
+
+	/* Warm up for the most common format */
+	l = limiter_create(&config);
+
+	for (;;) {
+		pthread_mutex_lock(&d->lock);
+		while (d->queue_count == 0) pthread_cond_wait(&d->not_empty, &d->lock);
+		connection = d->queue[d->queue_start];
+		d->queue_start = (d->queue_start + 1) % d->queue_size;
+		--d->queue_count;
+		pthread_cond_signal(&d->not_full);
+		pthread_mutex_unlock(&d->lock);
+
+		serve(connection, &l, &config);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	daemon_t d;
+	struct sockaddr_un address;
+	struct sigaction action;
+	sigset_t signals;
+	pthread_t thread;
+	unsigned int i, workers = DEFAULT_WORKERS;
+	int opt, listener, connection;
+	const char *error, *path;
+	struct timespec deadline;
+
+	memset(&d, 0, sizeof(d));
+	limiter_config_init(&d.config);
+	d.config.message = message;
+	d.queue_size = DEFAULT_QUEUE;
+
+	while ((opt = getopt(argc, argv, "+l:n:q:v")) != -1) switch (opt) {
+		case 'l':
+			if (sscanf(optarg, "%f", &d.config.max_lookahead) != 1) {
+				fprintf(stderr, usage, argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			workers = atoi(optarg);
+			break;
+		case 'q':
+			d.queue_size = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, usage, argv[0]);
+			return EXIT_FAILURE;
+	}
+	if (optind + 1 != argc || workers == 0 || d.queue_size == 0) {
+		fprintf(stderr, usage, argv[0]);
+		return EXIT_FAILURE;
+	}
+	if ((error = limiter_config_check(&d.config))) {
+		fprintf(stderr, "%s\n", error);
+		return EXIT_FAILURE;
+	}
+	path = argv[optind];
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "%s: socket name too long\n", path);
+		return EXIT_FAILURE;
+	}
+
+	if (!(d.queue = malloc(d.queue_size * sizeof(int)))) return EXIT_FAILURE;
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_cond_init(&d.not_empty, NULL);
+	pthread_cond_init(&d.not_full, NULL);
+
+	if ((listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, d.queue_size) < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	/* No SA_RESTART, so accept() returns on a signal */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The workers inherit a mask without the signals, so they interrupt accept() */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	for (i = 0; i < workers; ++i)
+		if (pthread_create(&thread, NULL, worker, &d) != 0 || pthread_detach(thread) != 0) {
+			fprintf(stderr, "Cannot start the workers\n");
+			return EXIT_FAILURE;
+		}
+	pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+	while (!quit) {
+		/*
+			Accept only when there is room in the queue. The signal handler
+			can't wake the condition, so the wait stops now and then to see quit
+		*/
+		pthread_mutex_lock(&d.lock);
+		while (d.queue_count == d.queue_size && !quit) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += STOP_CHECK_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				++deadline.tv_sec;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&d.not_full, &d.lock, &deadline);
+		}
+		pthread_mutex_unlock(&d.lock);
+		if (quit) break;
+
+		if ((connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("accept");
+			break;
+		}
+
+		pthread_mutex_lock(&d.lock);
+		d.queue[(d.queue_start + d.queue_count) % d.queue_size] = connection;
+		++d.queue_count;
+		pthread_cond_signal(&d.not_empty);
+		pthread_mutex_unlock(&d.lock);
+	}
+
+	close(listener);
+	unlink(path);
+	return quit ? EXIT_SUCCESS : EXIT_FAILURE;
+}
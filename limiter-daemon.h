@@ -0,0 +1,120 @@
+/*
+    Limiter daemon protocol
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIMITER_DAEMON_H
+#define LIMITER_DAEMON_H
+
+/*
+	limiter-daemon listens on a SOCK_SEQPACKET Unix socket. A client puts
+	the samples in a memfd sealed with F_SEAL_SHRINK, and sends a request
+	with the file descriptor attached (SCM_RIGHTS). The daemon limits the
+	samples in place and answers, the samples never go through the socket.
+	Other files are refused with EBADF.
+	A connection can send any number of requests, one at a time.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LIMITER_DAEMON_MAGIC 0x444d4c4c	/* "LLMD" */
+#define LIMITER_DAEMON_VERSION 1
+
+typedef struct {
+	uint32_t magic;			/* LIMITER_DAEMON_MAGIC */
+	uint32_t version;		/* LIMITER_DAEMON_VERSION */
+	uint32_t rate;			/* In Hz */
+	uint32_t channels;
+	uint32_t format;		/* limiter_format_t */
+	float threshold_db;
+	uint64_t offset;		/* Of the first sample in the file, in bytes */
+	uint64_t frames;
+} limiter_request_t;
+
+typedef struct {
+	int32_t error;			/* 0 or an errno value */
+	uint32_t reserved;
+	uint64_t frames;		/* Frames limited */
+	uint64_t slices;		/* Slices in these frames */
+	uint64_t actions;		/* Limited slices in these frames */
+} limiter_response_t;
+
+/* Returns the connected socket or -1 */
+static inline int limiter_daemon_connect(const char *path)
+{
+	struct sockaddr_un address;
+	int fd;
+
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) return -1;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+	Send a request with the file holding the samples and wait for the answer
+	Returns -1 if the daemon can't be reached, check response->error otherwise
+*/
+static inline int limiter_daemon_limit(const int socket, const int fd, const limiter_request_t *request,
+	limiter_response_t *response)
+{
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr *control;
+	union {
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control_buffer;
+	ssize_t n;
+
+	memset(&message, 0, sizeof(message));
+	memset(&control_buffer, 0, sizeof(control_buffer));
+	iov.iov_base = (void *)request;
+	iov.iov_len = sizeof(limiter_request_t);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control_buffer.buffer;
+	message.msg_controllen = sizeof(control_buffer.buffer);
+	control = CMSG_FIRSTHDR(&message);
+	control->cmsg_level = SOL_SOCKET;
+	control->cmsg_type = SCM_RIGHTS;
+	control->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(control), &fd, sizeof(int));
+
+	do n = sendmsg(socket, &message, MSG_NOSIGNAL);
+	while (n < 0 && errno == EINTR);
+	if (n != sizeof(limiter_request_t)) return -1;
+
+	do n = recv(socket, response, sizeof(limiter_response_t), 0);
+	while (n < 0 && errno == EINTR);
+	return n == sizeof(limiter_response_t) ? 0 : -1;
+}
+
+#endif
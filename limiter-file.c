@@ -0,0 +1,676 @@
+/*
+    File to file limiter
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Limit a PCM WAV or RAW file into a new file of the same format, without SoX.
+	Both files are memory mapped, the output is sized before processing and
+	its header is written last, so an interrupted run leaves no valid WAV.
+	The limiter core reads the samples from the input mapping into its
+	lookahead buffer and writes them from there to the output mapping:
+	one copy in and one copy out, the tool copies nothing itself.
+	WAV files are little endian, so is the host expected to be.
+	With - as input and output, RAW samples are limited from stdin to stdout.
+	With -Z too the output is vmspliced, see pipe_output().
+	With -D the samples are copied to a sealed memfd, limited there by
+	limiter-daemon and copied to the output.
+	With -p the input peak is declared (in dB, as from ReplayGain or R128
+	tags), -a measures it first: if it is under the threshold the limiter
+	is skipped and the samples are copied.
+	With -k the limiter state is saved every -K seconds of audio and on
+	SIGUSR1, after syncing the output written so far. -R resumes an
+	interrupted run from the checkpoint, with the same arguments: the
+	output is the same as from a run never interrupted.
+	Usage: limiter-file [-l max-lookahead (s)] [-j stats.json] [-s] [-v] [-w work-budget] [-D socket] [-Z]
+		[-p peak (dB) | -a] [-k checkpoint [-K seconds] [-R]] [-r rate -b bits [-f]] input output threshold (dB)
+*/
+
+#define _GNU_SOURCE /* vmsplice() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+
+#include "limiter.h"
+#include "limiter-wav.h"
+#include "limiter-daemon.h"
+
+#define BLOCK_FRAMES 4096	/* Frames offered to each limiter_process() call */
+#define PIPE_BLOCK (1 << 20)	/* Bytes read at most at a time in pipe mode */
+#define CHECKPOINT_SECONDS 600	/* Default audio time between checkpoints */
+
+static const char *usage = "Usage: %s [-l max-lookahead (s)] [-j stats.json] [-s] [-v] [-w work-budget] [-D socket] [-Z]"
+	" [-p peak (dB) | -a] [-k checkpoint [-K seconds] [-R]] [-r rate -b bits [-f]] input output threshold (dB)\n";
+static int verbose = 0;
+static volatile sig_atomic_t checkpoint_requested = 0;
+
+static void message(int level, const char *text, void *data)
+{
+	(void)data;
+	if (level == LIMITER_MESSAGE_DEBUG && !verbose) return;
+	fprintf(stderr, "%s\n", text);
+}
+
+static void request_checkpoint(int signal)
+{
+	(void)signal;
+	checkpoint_requested = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Write all of size bytes, returns -1 on error */
+static int write_all(const int fd, const uint8_t *data, size_t size)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = write(fd, data, size)) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+	Read up to size bytes after the partial frame left by the last read,
+	returns the whole frames available or -1 on error, *eof is set at the end
+*/
+static ssize_t read_frames(uint8_t *data, const size_t size, const size_t frame_size,
+	uint8_t *partial, size_t *partial_size, int *eof)
+{
+	ssize_t n;
+	size_t total;
+
+	memcpy(data, partial, *partial_size);
+	do n = read(STDIN_FILENO, data + *partial_size, size - *partial_size);
+	while (n < 0 && errno == EINTR);
+	if (n < 0) return -1;
+	if (n == 0) *eof = 1;
+	total = *partial_size + n;
+	*partial_size = total % frame_size;
+	memcpy(partial, data + total - *partial_size, *partial_size);
+	return total / frame_size;
+}
+
+/*
+	Hand the frames ready in the lookahead buffer to stdout, written
+	unless *splicing is set (-Z).
+	vmsplice() gives the pipe references to the buffer pages, not copies:
+	a frame is released only after the reader took it out of the pipe, that
+	is when the pipe holds fewer bytes than we spliced after it.
+	A reader that splices the pipe into another pipe still holds the pages
+	after that, and sees them written again, so this is only safe with
+	readers that copy.
+	*pending counts the bytes handed over and not released yet.
+	If stdout can't be spliced *splicing is cleared and the frames are written.
+*/
+static int pipe_output(limiter_t *l, const size_t frame_size, size_t *pending, int *splicing)
+{
+	const uint8_t *region;
+	size_t frames, released;
+	struct iovec iov;
+	ssize_t n;
+	int unread;
+
+	if (*splicing && *pending > 0 && ioctl(STDOUT_FILENO, FIONREAD, &unread) == 0) {
+		released = ((size_t)unread < *pending ? *pending - unread : 0) / frame_size;
+		limiter_output_release(l, released);
+		*pending -= released * frame_size;
+	}
+
+	region = limiter_output_region(l, &frames);
+	if (frames * frame_size <= *pending) return 0;
+	iov.iov_base = (void *)(region + *pending);
+	iov.iov_len = frames * frame_size - *pending;
+
+	if (*splicing) {
+		if ((n = vmsplice(STDOUT_FILENO, &iov, 1, 0)) >= 0) {
+			*pending += n;
+			return 0;
+		}
+		if (errno == EINTR) return 0;
+		if (errno != EINVAL && errno != EBADF && errno != ENOSYS) return -1;
+		*splicing = 0;
+		/* Nothing was spliced if splicing is not supported */
+	}
+	if (write_all(STDOUT_FILENO, iov.iov_base, iov.iov_len) < 0) return -1;
+	*pending += iov.iov_len;
+	released = *pending / frame_size;
+	limiter_output_release(l, released);
+	*pending -= released * frame_size;
+	return 0;
+}
+
+/*
+	Pipe mode for 32 bit integers: large reads go straight into the free
+	part of the lookahead buffer, ending on a page boundary when possible,
+	so the next read starts page aligned. The reads take what is free, the
+	buffer grows with the material in limiter_input_commit(), not with the
+	size of the reads.
+	Returns the number of frames written or -1 on error
+*/
+static int64_t pipe_direct(limiter_t *l, const size_t frame_size, int *splicing)
+{
+	const size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	uint8_t partial[16], *region;
+	size_t partial_size = 0, pending = 0, frames, size;
+	int64_t total = 0;
+	ssize_t whole;
+	int eof = 0, pipe_size;
+	struct timespec pause = {0, 1000000};
+
+	/* The pipe can hold references to a whole pipe buffer, make room for that and more */
+	pipe_size = *splicing ? fcntl(STDOUT_FILENO, F_GETPIPE_SZ) : 0;
+	frames = pipe_size > 0 ? 2 * (size_t)pipe_size / frame_size : 0;
+	limiter_input_region(l, &frames);
+
+	while (!eof) {
+		frames = 0;
+		region = limiter_input_region(l, &frames);
+		size = frames * frame_size;
+		if (size > PIPE_BLOCK) size = PIPE_BLOCK;
+		if (size > pagesize) size -= ((uintptr_t)region + size) % pagesize;
+		if (size <= partial_size) {
+			/* Full of frames still in the pipe, wait for the reader */
+			if (pipe_output(l, frame_size, &pending, splicing) < 0) return -1;
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		if ((whole = read_frames(region, size, frame_size, partial, &partial_size, &eof)) < 0) return -1;
+		limiter_input_commit(l, whole);
+		total += whole;
+		if (pipe_output(l, frame_size, &pending, splicing) < 0) return -1;
+	}
+	limiter_finish(l);
+	do {
+		if (pipe_output(l, frame_size, &pending, splicing) < 0) return -1;
+		limiter_output_region(l, &frames);
+	} while (frames * frame_size > pending);
+
+	return total;
+}
+
+/*
+	Pipe mode for the other formats, they are converted by the limiter
+	core between two buffers, read() and write() are used
+	Returns the number of frames written or -1 on error
+*/
+static int64_t pipe_copy(limiter_t *l, const size_t frame_size)
+{
+	uint8_t partial[16], *input, *output;
+	size_t partial_size = 0, consumed, iframes, oframes;
+	const size_t block = PIPE_BLOCK / frame_size;
+	int64_t total = 0;
+	ssize_t whole;
+	int eof = 0;
+
+	input = malloc(block * frame_size);
+	output = malloc(block * frame_size);
+	if (!input || !output) goto fail;
+
+	while (!eof) {
+		if ((whole = read_frames(input, block * frame_size, frame_size, partial, &partial_size, &eof)) < 0) goto fail;
+		for (consumed = 0; consumed < (size_t)whole; consumed += iframes) {
+			iframes = whole - consumed;
+			oframes = block;
+			limiter_process(l, input + consumed * frame_size, &iframes, output, &oframes);
+			if (write_all(STDOUT_FILENO, output, oframes * frame_size) < 0) goto fail;
+			total += oframes;
+		}
+	}
+	do {
+		oframes = block;
+		limiter_flush(l, output, &oframes);
+		if (write_all(STDOUT_FILENO, output, oframes * frame_size) < 0) goto fail;
+		total += oframes;
+	} while (oframes > 0);
+	goto out;
+
+fail:
+	total = -1;
+
+out:
+	free(input);
+	free(output);
+	return total;
+}
+
+/*
+	Let limiter-daemon limit the samples: they are copied to a memfd
+	sealed against shrinking, as the daemon wants, and back to output
+	Returns the number of frames limited or -1 on error
+*/
+static int64_t run_daemon(const char *path, const uint8_t *input, uint8_t *output,
+	const audio_format_t *format, const limiter_config_t *config, const size_t frames)
+{
+	limiter_request_t request;
+	limiter_response_t response;
+	uint8_t *samples = NULL;
+	int64_t limited = -1;
+	int daemon, fd;
+
+	if ((fd = memfd_create("limiter", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0
+		|| ftruncate(fd, format->data_size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0
+		|| (format->data_size > 0 && (samples = mmap(NULL, format->data_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, (off_t)0)) == MAP_FAILED)) {
+		perror("memfd");
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (samples) memcpy(samples, input, format->data_size);
+
+	if ((daemon = limiter_daemon_connect(path)) < 0) {
+		perror(path);
+		goto out;
+	}
+	memset(&request, 0, sizeof(request));
+	request.magic = LIMITER_DAEMON_MAGIC;
+	request.version = LIMITER_DAEMON_VERSION;
+	request.rate = format->rate;
+	request.channels = format->channels;
+	request.format = config->format;
+	request.threshold_db = config->threshold_db;
+	request.offset = 0;
+	request.frames = frames;
+
+	if (limiter_daemon_limit(daemon, fd, &request, &response) < 0)
+		perror(path);
+	else if (response.error)
+		fprintf(stderr, "%s: %s\n", path, strerror(response.error));
+	else {
+		if (samples) memcpy(output, samples, format->data_size);
+		limited = response.frames;
+		if (verbose)
+			fprintf(stderr, "Limited %" PRIu64 " of %" PRIu64 " slices\n", response.actions, response.slices);
+	}
+	close(daemon);
+
+out:
+	if (samples) munmap(samples, format->data_size);
+	close(fd);
+	return limited;
+}
+
+/*
+	Copy stdin to stdout, with splice() if they are pipes
+	Returns the number of bytes copied or -1 on error
+*/
+static int64_t pipe_bypass(void)
+{
+	uint8_t *buffer;
+	int64_t total = 0;
+	ssize_t n;
+
+	while ((n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, PIPE_BLOCK, SPLICE_F_MOVE)) != 0) {
+		if (n > 0) total += n;
+		else if (errno == EINVAL && total == 0) break;
+		else if (errno != EINTR) return -1;
+	}
+	if (n == 0) return total;
+
+	/* Not pipes */
+	if (!(buffer = malloc(PIPE_BLOCK))) return -1;
+	for (;;) {
+		if ((n = read(STDIN_FILENO, buffer, PIPE_BLOCK)) < 0 && errno == EINTR) continue;
+		if (n <= 0 || write_all(STDOUT_FILENO, buffer, n) < 0) break;
+		total += n;
+	}
+	free(buffer);
+	return n < 0 ? -1 : total;
+}
+
+/*
+	Limit RAW samples from stdin to stdout
+*/
+static int run_pipe(const audio_format_t *format, limiter_config_t *config, const double peak, int splicing)
+{
+	limiter_t *l;
+	const char *error, *path;
+	const size_t frame_size = format->channels * format->bits / 8;
+	int64_t frames;
+	double start, elapsed;
+
+	if (format->rate == 0 || format->bits == 0) {
+		fprintf(stderr, "Give -r and -b for the RAW samples of the pipe mode\n");
+		return EXIT_FAILURE;
+	}
+	config->rate = format->rate;
+	config->channels = format->channels;
+	if (sample_format(format, &config->format) < 0) {
+		fprintf(stderr, "%u bit %s samples are not supported\n", format->bits, format->is_float ? "float" : "integer");
+		return EXIT_FAILURE;
+	}
+	if ((error = limiter_config_check(config))) {
+		fprintf(stderr, "%s\n", error);
+		return EXIT_FAILURE;
+	}
+	if (peak >= 0 && limiter_bypass(config->threshold_db, peak)) {
+		if (verbose) fprintf(stderr, "Input peak under the threshold, limiter bypassed\n");
+		if ((frames = pipe_bypass()) < 0) perror("limiter-file");
+		return frames < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (!(l = limiter_create(config))) {
+		fprintf(stderr, "Cannot start the limiter\n");
+		return EXIT_FAILURE;
+	}
+
+	start = now();
+	if (config->format == LIMITER_FORMAT_S32) {
+		frames = pipe_direct(l, frame_size, &splicing);
+		path = splicing ? "vmsplice" : "read/write";
+	} else {
+		frames = pipe_copy(l, frame_size);
+		path = "read/write with conversion";
+	}
+	elapsed = now() - start;
+	if (frames < 0) perror("limiter-file");
+
+	if (verbose) {
+		limiter_report(l);
+		fprintf(stderr, "%s: %" PRId64 " frames in %.3f s, %.1f MB/s, %.0fx realtime\n", path, frames, elapsed,
+			elapsed > 0 ? frames * frame_size / elapsed / 1e6 : 0,
+			elapsed > 0 ? frames / (double)format->rate / elapsed : 0);
+	}
+	limiter_destroy(l);
+
+	return frames < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	audio_format_t format, wav;
+	limiter_config_t config;
+	limiter_t *l;
+	limiter_stats_t stats;
+	const char *error, *daemon = NULL, *checkpoint = NULL;
+	struct stat st;
+	uint8_t *input, *output;
+	size_t header_size, frame_size, frames, consumed, produced, iframes, oframes, next_checkpoint;
+	uint64_t position;
+	int in_fd, out_fd, opt, resume = 0, result = EXIT_FAILURE;
+	double start, elapsed, interval = CHECKPOINT_SECONDS, peak = -1;
+	int prescan = 0, splicing = 0;
+	char *end;
+
+	limiter_config_init(&config);
+	config.message = message;
+	memset(&format, 0, sizeof(format));
+	format.channels = 2;
+
+	while ((opt = getopt(argc, argv, "+l:j:svw:p:aD:Zk:K:Rr:b:f")) != -1) switch (opt) {
+		case 'l':
+			if (sscanf(optarg, "%f", &config.max_lookahead) != 1) {
+				fprintf(stderr, usage, argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'j':
+			config.stats_file = optarg;
+			break;
+		case 's':
+			config.channel_stats = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'p':
+			if (sscanf(optarg, "%lf", &peak) != 1) {
+				fprintf(stderr, usage, argv[0]);
+				return EXIT_FAILURE;
+			}
+			peak = pow(10, peak / 20);
+			break;
+		case 'a':
+			prescan = 1;
+			break;
+		case 'w':
+			/* strtoul() would take a sign, or nothing at all as 0 */
+			if (*optarg < '0' || *optarg > '9' || (config.work_budget = strtoul(optarg, &end, 10), *end)) {
+				fprintf(stderr, usage, argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'D':
+			daemon = optarg;
+			break;
+		case 'Z':
+			splicing = 1;
+			break;
+		case 'k':
+			checkpoint = optarg;
+			break;
+		case 'K':
+			interval = atof(optarg);
+			break;
+		case 'R':
+			resume = 1;
+			break;
+		case 'r':
+			format.rate = atoi(optarg);
+			break;
+		case 'b':
+			format.bits = atoi(optarg);
+			break;
+		case 'f':
+			format.is_float = 1;
+			break;
+		default:
+			fprintf(stderr, usage, argv[0]);
+			return EXIT_FAILURE;
+	}
+	if (optind + 3 != argc || sscanf(argv[optind + 2], "%f", &config.threshold_db) != 1
+		|| (resume && !checkpoint) || (checkpoint && daemon) || interval <= 0) {
+		fprintf(stderr, usage, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!strcmp(argv[optind], "-") || !strcmp(argv[optind + 1], "-")) {
+		if (strcmp(argv[optind], "-") || strcmp(argv[optind + 1], "-")) {
+			fprintf(stderr, "Pipe mode needs - as input and output\n");
+			return EXIT_FAILURE;
+		}
+		if (checkpoint || prescan) {
+			fprintf(stderr, "Checkpoints and -a need files\n");
+			return EXIT_FAILURE;
+		}
+		return run_pipe(&format, &config, peak, splicing);
+	}
+
+	if ((in_fd = open(argv[optind], O_RDONLY)) < 0 || fstat(in_fd, &st) < 0) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	input = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, in_fd, (off_t)0) : MAP_FAILED;
+	if (input == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	madvise(input, st.st_size, MADV_SEQUENTIAL);
+
+	/* RAW needs the format on the command line, WAV brings its own */
+	wav = format;
+	if (parse_wav(input, st.st_size, &wav) == 0) format = wav;
+	else if (st.st_size >= 4 && !memcmp(input, "RIFF", 4)) {
+		fprintf(stderr, "%s is not a PCM WAV file\n", argv[optind]);
+		return EXIT_FAILURE;
+	} else {
+		if (format.rate == 0 || format.bits == 0) {
+			fprintf(stderr, "%s is not a PCM WAV file, give -r and -b for RAW input\n", argv[optind]);
+			return EXIT_FAILURE;
+		}
+		format.data_offset = 0;
+		format.data_size = st.st_size;
+	}
+	config.rate = format.rate;
+	config.channels = format.channels;
+	if (sample_format(&format, &config.format) < 0) {
+		fprintf(stderr, "%u bit %s samples are not supported\n", format.bits, format.is_float ? "float" : "integer");
+		return EXIT_FAILURE;
+	}
+	if ((error = limiter_config_check(&config))) {
+		fprintf(stderr, "%s\n", error);
+		return EXIT_FAILURE;
+	}
+	frame_size = format.channels * format.bits / 8;
+	frames = format.data_size / frame_size;
+	format.data_size = frames * frame_size;
+	header_size = format.wav ? WAV_HEADER_SIZE : 0;
+	if (format.wav && format.data_size > UINT32_MAX - WAV_HEADER_SIZE) {
+		fprintf(stderr, "%s is too big for a WAV file\n", argv[optind + 1]);
+		return EXIT_FAILURE;
+	}
+
+	/* The output has its final size from the start, so it can be mapped at once */
+	if ((out_fd = open(argv[optind + 1], resume ? O_RDWR : O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0) {
+		perror(argv[optind + 1]);
+		return EXIT_FAILURE;
+	}
+	if (ftruncate(out_fd, header_size + format.data_size) < 0) {
+		perror(argv[optind + 1]);
+		return EXIT_FAILURE;
+	}
+	output = header_size + format.data_size > 0 ? mmap(NULL, header_size + format.data_size,
+		PROT_READ|PROT_WRITE, MAP_SHARED, out_fd, (off_t)0) : NULL;
+	if (output == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s\n", argv[optind + 1]);
+		return EXIT_FAILURE;
+	}
+	if (output) madvise(output, header_size + format.data_size, MADV_SEQUENTIAL);
+
+	if (prescan) {
+		start = now();
+		peak = limiter_peak(input + format.data_offset, frames * format.channels, config.format);
+		if (verbose) fprintf(stderr, "Input peak %.2f dB, measured in %.3f s\n", 20 * log10(peak), now() - start);
+	}
+	if (peak >= 0 && limiter_bypass(config.threshold_db, peak)) {
+		/* The samples would come out unchanged */
+		if (verbose) fprintf(stderr, "Input peak under the threshold, limiter bypassed\n");
+		if (format.data_size > 0) memcpy(output + header_size, input + format.data_offset, format.data_size);
+		if (format.wav) write_wav_header(output, &format);
+		munmap(input, st.st_size);
+		close(in_fd);
+		result = EXIT_SUCCESS;
+		if (output && munmap(output, header_size + format.data_size) < 0) result = EXIT_FAILURE;
+		if (close(out_fd) < 0) result = EXIT_FAILURE;
+		return result;
+	}
+
+	if (daemon) {
+		/* Statistics stay in the daemon, only the counts come back */
+		start = now();
+		result = run_daemon(daemon, input + format.data_offset, output + header_size, &format, &config, frames)
+			== (int64_t)frames
+			? EXIT_SUCCESS : EXIT_FAILURE;
+		elapsed = now() - start;
+		if (result == EXIT_SUCCESS && format.wav) write_wav_header(output, &format);
+		if (verbose)
+			fprintf(stderr, "%lu frames in %.3f s, %.0fx realtime\n", (unsigned long)frames, elapsed,
+				elapsed > 0 ? frames / (double)format.rate / elapsed : 0);
+		munmap(input, st.st_size);
+		close(in_fd);
+		if (output && munmap(output, header_size + format.data_size) < 0) result = EXIT_FAILURE;
+		if (close(out_fd) < 0) result = EXIT_FAILURE;
+		return result;
+	}
+
+	if (!(l = limiter_create(&config))) {
+		fprintf(stderr, "Cannot start the limiter\n");
+		return EXIT_FAILURE;
+	}
+
+	consumed = produced = 0;
+	if (resume) {
+		/* The frames consumed and not in the buffer are in the output already */
+		if (limiter_restore(l, checkpoint, &position) < 0 || position > frames) {
+			fprintf(stderr, "Cannot resume from %s\n", checkpoint);
+			return EXIT_FAILURE;
+		}
+		limiter_get_stats(l, &stats);
+		consumed = position;
+		produced = consumed - stats.buffered;
+		if (verbose) fprintf(stderr, "Resumed after %lu frames\n", (unsigned long)consumed);
+	}
+	if (checkpoint) signal(SIGUSR1, request_checkpoint);
+	next_checkpoint = consumed + interval * format.rate;
+
+	start = now();
+	while (consumed < frames) {
+		iframes = frames - consumed < BLOCK_FRAMES ? frames - consumed : BLOCK_FRAMES;
+		oframes = frames - produced;
+		if (limiter_process(l, input + format.data_offset + consumed * frame_size, &iframes,
+			output + header_size + produced * frame_size, &oframes) < 0) break;
+		consumed += iframes;
+		produced += oframes;
+
+		if (checkpoint && (consumed >= next_checkpoint || checkpoint_requested)) {
+			/* The checkpoint refers to the output written so far, it must reach the disk first */
+			if (msync(output, header_size + produced * frame_size, MS_SYNC) < 0
+				|| limiter_checkpoint(l, checkpoint, consumed) < 0)
+				fprintf(stderr, "Cannot write checkpoint %s\n", checkpoint);
+			else if (verbose) fprintf(stderr, "Checkpoint after %lu frames\n", (unsigned long)consumed);
+			checkpoint_requested = 0;
+			next_checkpoint = consumed + interval * format.rate;
+		}
+	}
+	while (produced < frames) {
+		oframes = frames - produced;
+		if (limiter_flush(l, output + header_size + produced * frame_size, &oframes) < 0 || oframes == 0) break;
+		produced += oframes;
+	}
+	elapsed = now() - start;
+
+	if (produced == frames) {
+		if (format.wav) write_wav_header(output, &format);
+		if (checkpoint) unlink(checkpoint);
+		result = EXIT_SUCCESS;
+	} else fprintf(stderr, "Limiter failed after %lu frames\n", (unsigned long)produced);
+
+	if (verbose) {
+		limiter_report(l);
+		fprintf(stderr, "%lu frames in %.3f s, %.0fx realtime\n", (unsigned long)frames, elapsed,
+			elapsed > 0 ? frames / (double)format.rate / elapsed : 0);
+	}
+	limiter_destroy(l);
+
+	munmap(input, st.st_size);
+	close(in_fd);
+	if (output && munmap(output, header_size + format.data_size) < 0) result = EXIT_FAILURE;
+	if (close(out_fd) < 0) result = EXIT_FAILURE;
+
+	return result;
+}
@@ -0,0 +1,190 @@
+/*
+    LADSPA limiter
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	The limiter core as a LADSPA plugin for live hosts (JACK, Carla, Ardour).
+	The lookahead buffer is allocated by instantiate() at its final size,
+	run() uses limiter_process_fixed(): no allocation, lock or system call,
+	and a constant latency, reported on the latency output port.
+	A slice longer than the latency is cut where its first frame is due.
+	Each block has a work budget: a long slice found late is clipped
+	rather than making one run() much slower than the others.
+	LADSPA buffers are one per channel, run() interleaves them on the stack
+	in blocks of BLOCK_FRAMES, so input and output can be the same buffer.
+	Float hosts carry overs: the signal is scaled down by HEADROOM on the
+	way in and up on the way out, so input up to +12 dBFS is limited,
+	louder input is clipped. The threshold goes down to -28 dB.
+*/
+
+#include <stdlib.h>
+#include <ladspa.h>
+
+#include "limiter.h"
+
+/*
+	Provisional, not allocated from the LADSPA registry (ladspa.org), so it
+	can collide with another plugin. Hosts save sessions with it: it must be
+	registered, and changed here if needed, before a release.
+*/
+#define UNIQUE_ID 5930
+#define LOOKAHEAD 0.05f		/* In seconds, the latency, rounded up to a page of samples */
+#define BLOCK_FRAMES 256	/* Frames interleaved at a time by run() */
+#define WORK_BUDGET (BLOCK_FRAMES * 2 * 8)	/* Samples searched and limited for each block */
+#define HEADROOM 4.0f		/* Scale of the input limited instead of clipped, a power of two is exact */
+#define HEADROOM_DB 12.0412f	/* 20 log10(HEADROOM) */
+#define THRESHOLD_MIN (LIMITER_THRESHOLD_MIN + HEADROOM_DB)
+
+enum {
+	PORT_INPUT_LEFT,
+	PORT_INPUT_RIGHT,
+	PORT_OUTPUT_LEFT,
+	PORT_OUTPUT_RIGHT,
+	PORT_THRESHOLD,
+	PORT_LATENCY,
+	PORTS
+};
+
+typedef struct {
+	limiter_t *core;
+	LADSPA_Data *ports[PORTS];
+	float threshold_db;		/* Threshold of the port, the core has HEADROOM_DB less */
+} plugin_t;
+
+static const LADSPA_PortDescriptor port_descriptors[PORTS] = {
+	LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO,
+	LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO,
+	LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+	LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+	LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+	LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL
+};
+static const char * const port_names[PORTS] = {
+	"Input L", "Input R", "Output L", "Output R", "Threshold (dB)", "latency"
+};
+static const LADSPA_PortRangeHint port_hints[PORTS] = {
+	{0, 0, 0},
+	{0, 0, 0},
+	{0, 0, 0},
+	{0, 0, 0},
+	{LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE | LADSPA_HINT_DEFAULT_MAXIMUM, THRESHOLD_MIN, 0},
+	{0, 0, 0}
+};
+
+static LADSPA_Handle instantiate(const LADSPA_Descriptor *descriptor, unsigned long rate)
+{
+	plugin_t *p;
+	limiter_config_t config;
+
+	(void)descriptor;
+	if (!(p = (plugin_t *) calloc(1, sizeof(plugin_t)))) return NULL;
+
+	limiter_config_init(&config);
+	config.rate = rate;
+	config.format = LIMITER_FORMAT_FLOAT;
+	config.max_lookahead = LOOKAHEAD;
+	config.realtime = 1;
+	config.work_budget = WORK_BUDGET;
+	config.threshold_db = -HEADROOM_DB;
+	if (!(p->core = limiter_create(&config))) {
+		free(p);
+		return NULL;
+	}
+	p->threshold_db = 0;
+
+	return p;
+}
+
+static void connect_port(LADSPA_Handle instance, unsigned long port, LADSPA_Data *data)
+{
+	plugin_t *p = (plugin_t *) instance;
+
+	if (port < PORTS) p->ports[port] = data;
+}
+
+static void activate(LADSPA_Handle instance)
+{
+	plugin_t *p = (plugin_t *) instance;
+
+	limiter_reset(p->core);
+	/* Hosts read the latency after activate() for their delay compensation */
+	if (p->ports[PORT_LATENCY]) *p->ports[PORT_LATENCY] = limiter_latency(p->core);
+}
+
+static void run(LADSPA_Handle instance, unsigned long frames)
+{
+	plugin_t *p = (plugin_t *) instance;
+	float input[BLOCK_FRAMES * 2], output[BLOCK_FRAMES * 2];
+	float threshold_db = *p->ports[PORT_THRESHOLD];
+	unsigned long done, count, i;
+
+	threshold_db = threshold_db < THRESHOLD_MIN ? THRESHOLD_MIN : threshold_db > 0 ? 0 : threshold_db;
+	if (threshold_db != p->threshold_db) {
+		limiter_set_threshold(p->core, threshold_db - HEADROOM_DB);
+		p->threshold_db = threshold_db;
+	}
+
+	for (done = 0; done < frames; done += count) {
+		count = frames - done < BLOCK_FRAMES ? frames - done : BLOCK_FRAMES;
+		for (i = 0; i < count; ++i) {
+			input[2 * i] = p->ports[PORT_INPUT_LEFT][done + i] * (1 / HEADROOM);
+			input[2 * i + 1] = p->ports[PORT_INPUT_RIGHT][done + i] * (1 / HEADROOM);
+		}
+		limiter_process_fixed(p->core, input, output, count);
+		for (i = 0; i < count; ++i) {
+			p->ports[PORT_OUTPUT_LEFT][done + i] = output[2 * i] * HEADROOM;
+			p->ports[PORT_OUTPUT_RIGHT][done + i] = output[2 * i + 1] * HEADROOM;
+		}
+	}
+
+	if (p->ports[PORT_LATENCY]) *p->ports[PORT_LATENCY] = limiter_latency(p->core);
+}
+
+static void cleanup(LADSPA_Handle instance)
+{
+	plugin_t *p = (plugin_t *) instance;
+
+	limiter_destroy(p->core);
+	free(p);
+}
+
+static const LADSPA_Descriptor descriptor = {
+	UNIQUE_ID,
+	"limiter",
+	LADSPA_PROPERTY_HARD_RT_CAPABLE,
+	"Zero crossing limiter",
+	"Guido Aulisi",
+	"GPL",
+	PORTS,
+	port_descriptors,
+	port_names,
+	port_hints,
+	NULL,
+	instantiate,
+	connect_port,
+	activate,
+	run,
+	NULL,
+	NULL,
+	NULL,
+	cleanup
+};
+
+const LADSPA_Descriptor *ladspa_descriptor(unsigned long index)
+{
+	return index == 0 ? &descriptor : NULL;
+}
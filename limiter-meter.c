@@ -0,0 +1,110 @@
+/*
+    Live meter for the SoX limiter
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Print the live meter of a limiter started with -m name,
+	or change its threshold with -t
+	Usage: limiter-meter [-t threshold (dB)] name [interval (ms)]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "limiter.h"
+
+#define CO_DB(v) (20.0 * log10(v))
+
+int main(int argc, char *argv[])
+{
+	int fd, opt, set_threshold = 0;
+	long interval = 1000;
+	double threshold = 0;
+	limiter_meter_t *meter;
+	limiter_meter_t copy;
+	struct stat st;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) switch (opt) {
+		case 't':
+			if (sscanf(optarg, "%lf", &threshold) != 1 || threshold > 0 || threshold < -40) {
+				fprintf(stderr, "threshold must be from -40 to 0\n");
+				return EXIT_FAILURE;
+			}
+			set_threshold = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t threshold (dB)] name [interval (ms)]\n", argv[0]);
+			return EXIT_FAILURE;
+	}
+	argc -= optind - 1, argv += optind - 1;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s [-t threshold (dB)] name [interval (ms)]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc == 3 && (sscanf(argv[2], "%ld", &interval) != 1 || interval <= 0)) {
+		fprintf(stderr, "Invalid interval %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	fd = shm_open(argv[1], set_threshold ? O_RDWR : O_RDONLY, 0);
+	if (fd < 0) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	/* A segment of an older limiter is smaller, don't map past its end */
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(limiter_meter_t)) {
+		fprintf(stderr, "%s is not a limiter meter of this version\n", argv[1]);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	meter = mmap(NULL, sizeof(limiter_meter_t), set_threshold ? PROT_READ|PROT_WRITE : PROT_READ,
+		MAP_SHARED, fd, (off_t)0);
+	close(fd);
+	if (meter == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	if (meter->magic != LIMITER_METER_MAGIC || meter->version != LIMITER_METER_VERSION) {
+		fprintf(stderr, "%s is not a limiter meter\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if (set_threshold) {
+		limiter_meter_set_threshold(meter, threshold);
+		return EXIT_SUCCESS;
+	}
+
+	for (;;) {
+		if (limiter_meter_read(meter, &copy) == 0)
+			printf("threshold %.1f dB gain %.1f dB max reduction %.1f dB"
+				" actions %" PRIu64 " slices %" PRIu64 " forced %" PRIu64 " fill %.0f%%\n",
+				copy.threshold_db, CO_DB(copy.gain), copy.min_gain > 0 ? CO_DB(1 / copy.min_gain) : 0.0,
+				copy.actions, copy.slices, copy.forced,
+				copy.size ? 100.0 * copy.fill / copy.size : 0.0);
+		fflush(stdout);
+		usleep(interval * 1000);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,266 @@
+/*
+    Workload replay for the SoX limiter
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Replay a workload captured with the limiter -c option: a signal with
+	the same slice lengths and peaks is generated and fed to the limiter
+	with the same limiter_process() and limiter_flush() call sizes, the
+	processing is timed. The calls and the mean latency of flow (frames given
+	and not returned yet) are printed. It is linked with limiter_core.c, SoX
+	is not needed.
+	Usage: limiter-replay [-n iterations] capture-file
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "limiter.h"
+
+#define DEFAULT_ROOM 8192	/* Samples offered once the captured calls are over */
+
+typedef struct {
+	int tag;
+	uint64_t value[4];
+} record_t;
+
+typedef struct {
+	unsigned int rate;
+	unsigned int channels;
+	double threshold_db;
+	double max_lookahead;
+	record_t *records;
+	size_t count;
+	uint64_t frames;		/* Total length of the slices */
+	size_t max_room;		/* Biggest output room offered */
+} capture_t;
+
+static int read_number(FILE *f, uint64_t *value)
+{
+	int c, shift = 0;
+
+	*value = 0;
+	do {
+		if ((c = getc(f)) == EOF || shift > 63) return -1;
+		*value |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+static int read_capture(const char *name, capture_t *capture)
+{
+	FILE *f;
+	char magic[sizeof(LIMITER_CAPTURE_MAGIC) - 1];
+	uint64_t version, header[4];
+	unsigned int i, numbers;
+	size_t allocated = 0;
+	record_t *record;
+	int tag;
+
+	if (!(f = fopen(name, "rb"))) return -1;
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, LIMITER_CAPTURE_MAGIC, sizeof(magic))
+		|| read_number(f, &version) || version != LIMITER_CAPTURE_VERSION) {
+		fclose(f);
+		return -1;
+	}
+	for (i = 0; i < 4; ++i)
+		if (read_number(f, &header[i])) {
+			fclose(f);
+			return -1;
+		}
+	capture->rate = header[0];
+	capture->channels = header[1];
+	capture->threshold_db = -(double)header[2] / 100;
+	capture->max_lookahead = (double)header[3] / 1000;
+	capture->records = NULL;
+	capture->count = 0;
+	capture->frames = 0;
+	capture->max_room = DEFAULT_ROOM;
+
+	while ((tag = getc(f)) != EOF && tag != LIMITER_CAPTURE_END) {
+		switch (tag) {
+			case LIMITER_CAPTURE_FLOW: numbers = 4; break;
+			case LIMITER_CAPTURE_SLICE: numbers = 2; break;
+			case LIMITER_CAPTURE_DRAIN: numbers = 2; break;
+			default: numbers = 0; break;
+		}
+		if (numbers == 0) break;
+		if (capture->count == allocated) {
+			allocated = allocated ? allocated * 2 : 4096;
+			if (!(record = realloc(capture->records, allocated * sizeof(record_t)))) break;
+			capture->records = record;
+		}
+		record = capture->records + capture->count;
+		record->tag = tag;
+		for (i = 0; i < numbers; ++i)
+			if (read_number(f, &record->value[i])) break;
+		if (i < numbers) break;
+		++capture->count;
+		if (tag == LIMITER_CAPTURE_SLICE) capture->frames += record->value[0];
+		if (tag == LIMITER_CAPTURE_FLOW && record->value[1] > capture->max_room) capture->max_room = record->value[1];
+		if (tag == LIMITER_CAPTURE_DRAIN && record->value[0] > capture->max_room) capture->max_room = record->value[0];
+	}
+	fclose(f);
+
+	return tag == LIMITER_CAPTURE_END ? 0 : -1;
+}
+
+/*
+	Generate one slice: a sine period reaching peak on the first channel,
+	the other channels at half level, the last frame is silent so the next
+	slice starts with a zero crossing
+*/
+static void generate_slice(int32_t *frame, const uint64_t length, const uint64_t peak, const unsigned int channels)
+{
+	uint64_t n, loudest = 0;
+	unsigned int c;
+	double value, highest = 0;
+
+	for (n = 0; n < length; ++n) {
+		value = 0;
+		if (n + 1 < length) {
+			value = sin(2 * M_PI * (n + 0.5) / (length - 1));
+			if (fabs(value) > highest) {
+				highest = fabs(value);
+				loudest = n;
+			}
+		}
+		frame[n * channels] = value * peak;
+	}
+	/* Reach exactly the peak, and start above zero */
+	if (length > 1 && peak > 0) {
+		frame[loudest * channels] = frame[loudest * channels] < 0 ? -(int32_t)peak : (int32_t)peak;
+		if (frame[0] <= 0) frame[0] = 1;
+	}
+	for (n = 0; n < length; ++n)
+		for (c = 1; c < channels; ++c)
+			frame[n * channels + c] = frame[n * channels] / 2;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	capture_t capture;
+	int32_t *signal, *output;
+	uint64_t position;
+	size_t i, iframes, oframes, consumed, produced, flows, drains;
+	double lag;
+	unsigned int iteration, iterations = 1;
+	limiter_config_t config;
+	limiter_t *l;
+	double start, elapsed, best = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] capture-file\n", argv[0]);
+			return EXIT_FAILURE;
+	}
+	if (optind + 1 != argc || iterations == 0) {
+		fprintf(stderr, "Usage: %s [-n iterations] capture-file\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (read_capture(argv[optind], &capture) < 0 || capture.channels == 0) {
+		fprintf(stderr, "Cannot read capture %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	signal = malloc(capture.frames * capture.channels * sizeof(int32_t));
+	output = malloc(capture.max_room * sizeof(int32_t));
+	if (!signal || !output) {
+		fprintf(stderr, "Cannot allocate the signal\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0, position = 0; i < capture.count; ++i)
+		if (capture.records[i].tag == LIMITER_CAPTURE_SLICE) {
+			generate_slice(signal + position * capture.channels, capture.records[i].value[0],
+				capture.records[i].value[1], capture.channels);
+			position += capture.records[i].value[0];
+		}
+
+	limiter_config_init(&config);
+	config.rate = capture.rate;
+	config.channels = capture.channels;
+	config.threshold_db = capture.threshold_db;
+	config.max_lookahead = capture.max_lookahead;
+
+	for (iteration = 0; iteration < iterations; ++iteration) {
+		if (!(l = limiter_create(&config))) {
+			fprintf(stderr, "Cannot start the limiter\n");
+			return EXIT_FAILURE;
+		}
+
+		flows = drains = 0;
+		consumed = produced = 0;
+		lag = 0;
+		start = now();
+		/* Same calls as captured, then default sizes until the input is over, the capture counts samples */
+		for (i = 0; i < capture.count || consumed < capture.frames; ++i) {
+			if (i < capture.count && capture.records[i].tag != LIMITER_CAPTURE_FLOW) continue;
+			iframes = (i < capture.count ? capture.records[i].value[0] : DEFAULT_ROOM) / capture.channels;
+			oframes = (i < capture.count ? capture.records[i].value[1] : DEFAULT_ROOM) / capture.channels;
+			if (iframes > capture.frames - consumed)
+				iframes = capture.frames - consumed;
+			if (iframes == 0 && i >= capture.count) break;
+			limiter_process(l, signal + consumed * capture.channels, &iframes, output, &oframes);
+			consumed += iframes;
+			produced += oframes;
+			/* Frames given to the limiter and not back yet when flow returns */
+			lag += consumed - produced;
+			++flows;
+		}
+		do {
+			oframes = DEFAULT_ROOM / capture.channels;
+			limiter_flush(l, output, &oframes);
+			++drains;
+		} while (oframes > 0);
+		elapsed = now() - start;
+		if (iteration == 0 || elapsed < best) best = elapsed;
+
+		limiter_destroy(l);
+	}
+
+	printf("%" PRIu64 " frames, %lu flow calls, %lu drain calls\n",
+		capture.frames, (unsigned long)flows, (unsigned long)drains);
+	printf("%lu frames out of flow, mean latency %.0f frames (%.1f ms)\n", (unsigned long)produced,
+		flows ? lag / flows : 0, flows ? lag / flows * 1000 / capture.rate : 0);
+	printf("best of %u: %.3f ms, %.2f ns per sample, %.0fx realtime\n", iterations, best * 1000,
+		best * 1e9 / (capture.frames * capture.channels), capture.frames / (double)capture.rate / best);
+
+	free(signal);
+	free(output);
+	free(capture.records);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,259 @@
+/*
+    Limiter output check
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Check that the output of the limiter doesn't depend on how it is fed:
+	the same signal is limited with limiter_process() calls of different
+	sizes, and interrupted by a checkpoint and resumed in a new limiter,
+	and with work budgets, and the outputs are compared byte for byte with
+	the first one. The signals have stretches without zero crossings,
+	shorter and longer than the lookahead, and the checkpoints are taken
+	inside them. In fixed latency mode a budget of one sample must clip
+	every forced frame.
+	It is linked with limiter_core.c, SoX is not needed:
+	cc -O2 -o limiter-test limiter-test.c limiter_core.c -lm -lpthread -lrt
+	Prints a line per signal and exits with 1 if an output differs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "limiter.h"
+
+#define RATE 44100
+#define CHANNELS 2
+#define THRESHOLD -6.0f		/* in dB */
+#define LOOKAHEAD 2.0f		/* in seconds */
+#define LEVEL (0.9 * INT32_MAX)
+
+/* Frames per limiter_process() call, the output room is the same as in SoX */
+static const size_t calls[] = {4096, 1, 1000, 2048, 4410, 65536};
+
+/* Work budgets in samples, with calls of calls[0] frames */
+static const size_t budgets[] = {1, 2, 3, 4, 5, 64, 1000, 4096};
+
+/*
+	Calls in a row without input or output: with a budget a call can only
+	search, but at least a frame further, so it is bounded by the lookahead
+*/
+#define MAX_IDLE ((size_t)(2 * LOOKAHEAD * RATE))
+
+/* Frames per limiter_process_fixed() call and seconds of the ramp */
+#define FIXED_CALL 256
+#define FIXED_RAMP 1.0
+typedef struct {
+	const char *name;
+	double flat;			/* Seconds of a positive ramp, without zero crossings */
+	double sine;			/* Seconds of a 441 Hz sine after it */
+	double checkpoints[3];	/* Seconds of input before a checkpoint, 0 for none */
+} signal_t;
+
+static const signal_t signals[] = {
+	{"sine", 0, 2, {0.5, 1.2, 0}},
+	{"ramp, shorter than the lookahead", 1, 0.5, {0.3, 0.9, 0}},
+	{"ramp, longer than the lookahead", 5, 0.5, {1.5, 2.5, 4.2}}
+};
+
+static int32_t *make_signal(const signal_t *s, size_t *frames)
+{
+	const size_t flat = (size_t)(s->flat * RATE);
+	size_t i;
+	int32_t *samples;
+
+	*frames = flat + (size_t)(s->sine * RATE);
+	if (!(samples = (int32_t *) malloc(*frames * CHANNELS * sizeof(int32_t)))) return NULL;
+	for (i = 0; i < *frames; i++)
+		/* The ramp crosses the threshold, so where a slice is cut changes its gain */
+		samples[i * CHANNELS] = samples[i * CHANNELS + 1] = i < flat ? (int32_t)(LEVEL * (0.1 + 0.9 * i / flat))
+			: (int32_t)(LEVEL * sin(2 * M_PI * 441 * (i - flat) / RATE));
+	return samples;
+}
+
+static limiter_t *create(size_t budget, int realtime)
+{
+	limiter_config_t config;
+
+	limiter_config_init(&config);
+	config.rate = RATE;
+	config.channels = CHANNELS;
+	config.threshold_db = THRESHOLD;
+	config.max_lookahead = realtime ? 0.05f : LOOKAHEAD;
+	config.work_budget = budget;
+	config.realtime = realtime;
+	return limiter_create(&config);
+}
+
+/* The checkpoint keeps the counters, the lookahead buffer grows with the calls */
+static int same_stats(const limiter_stats_t *a, const limiter_stats_t *b)
+{
+	return a->threshold_db == b->threshold_db && a->gain == b->gain && a->min_gain == b->min_gain
+		&& a->actions == b->actions && a->slices == b->slices && a->forced == b->forced
+		&& a->overruns == b->overruns && a->clipped == b->clipped && a->buffered == b->buffered;
+}
+
+/*
+	Limit frames frames of in into out with calls of call frames,
+	with a checkpoint and a new limiter after checkpoint frames if not 0,
+	and a work budget of budget samples if not 0.
+	Returns the frames produced, 0 on error
+*/
+static size_t run(const int32_t *in, size_t frames, int32_t *out, size_t call, size_t checkpoint,
+	size_t budget, const char *file_name, limiter_stats_t *stats)
+{
+	limiter_t *l = create(budget, 0);
+	size_t idle = 0;
+	size_t consumed = 0, produced = 0, iframes, oframes;
+	uint64_t position;
+
+	if (!l) return 0;
+	while (consumed < frames) {
+		iframes = call < frames - consumed ? call : frames - consumed;
+		oframes = call < frames - produced ? call : frames - produced;
+		if (limiter_process(l, in + consumed * CHANNELS, &iframes, out + produced * CHANNELS, &oframes) < 0
+			|| (iframes == 0 && oframes == 0 && ++idle > MAX_IDLE)) {
+			limiter_destroy(l);
+			return 0;
+		}
+		if (iframes || oframes) idle = 0;
+		consumed += iframes;
+		produced += oframes;
+
+		if (checkpoint && consumed >= checkpoint) {
+			checkpoint = 0;
+			if (limiter_checkpoint(l, file_name, consumed) < 0) {
+				limiter_destroy(l);
+				return 0;
+			}
+			limiter_destroy(l);
+			if (!(l = create(budget, 0)) || limiter_restore(l, file_name, &position) < 0 || position != consumed) {
+				if (l) limiter_destroy(l);
+				return 0;
+			}
+			unlink(file_name);
+		}
+	}
+	do {
+		oframes = frames - produced;
+		if (limiter_flush(l, out + produced * CHANNELS, &oframes) < 0) break;
+		produced += oframes;
+	} while (oframes > 0);
+
+	limiter_get_stats(l, stats);
+	limiter_destroy(l);
+	return produced;
+}
+
+/*
+	A positive ramp has no zero crossing, in fixed latency mode every frame
+	after the silence of the latency is forced: with a budget of one sample
+	all of them are clipped, without a budget none is.
+	Returns 1 if the clipped frames are not those expected
+*/
+static int check_fixed(void)
+{
+	const size_t frames = (size_t)(FIXED_RAMP * RATE) / FIXED_CALL * FIXED_CALL;
+	const size_t budgets_fixed[2] = {0, 1};
+	int32_t in[FIXED_CALL * CHANNELS], out[FIXED_CALL * CHANNELS];
+	limiter_stats_t stats;
+	limiter_t *l;
+	size_t i, k, expected;
+
+	for (k = 0; k < 2; k++) {
+		if (!(l = create(budgets_fixed[k], 1))) {
+			printf("fixed latency: the limiter failed\n");
+			return 1;
+		}
+		expected = budgets_fixed[k] ? frames - limiter_latency(l) : 0;
+		for (i = 0; i < frames; i++) {
+			in[i % FIXED_CALL * CHANNELS] = in[i % FIXED_CALL * CHANNELS + 1] = (int32_t)(LEVEL * (0.1 + 0.9 * i / frames));
+			if ((i + 1) % FIXED_CALL == 0) limiter_process_fixed(l, in, out, FIXED_CALL);
+		}
+		limiter_get_stats(l, &stats);
+		limiter_destroy(l);
+		printf("fixed latency, budget of %zu samples: %" PRIu64 " frames clipped, %zu expected\n",
+			budgets_fixed[k], stats.clipped, expected);
+		if (stats.clipped != expected) return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	size_t i, c, k, frames, produced;
+	int failed = 0, differs;
+	int32_t *in, *reference, *out;
+	limiter_stats_t stats, reference_stats;
+	char file_name[64];
+
+	snprintf(file_name, sizeof(file_name), "/tmp/limiter-test-%ld.ckpt", (long) getpid());
+
+	for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+		if (!(in = make_signal(&signals[i], &frames))
+			|| !(reference = (int32_t *) calloc(frames * CHANNELS, sizeof(int32_t)))
+			|| !(out = (int32_t *) malloc(frames * CHANNELS * sizeof(int32_t)))) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		differs = 0;
+
+		if (run(in, frames, reference, calls[0], 0, 0, file_name, &reference_stats) != frames) {
+			printf("%s: the limiter failed\n", signals[i].name);
+			differs = 1;
+		}
+		else for (c = 0; c < sizeof(calls) / sizeof(calls[0]); c++)
+			for (k = 0; k <= sizeof(signals[i].checkpoints) / sizeof(signals[i].checkpoints[0]); k++) {
+				/* k == 0 is a run without checkpoint */
+				const double seconds = k ? signals[i].checkpoints[k - 1] : 0;
+
+				if (k && seconds == 0) continue;
+				memset(out, 0, frames * CHANNELS * sizeof(int32_t));
+				produced = run(in, frames, out, calls[c], (size_t)(seconds * RATE), 0, file_name, &stats);
+				if (produced != frames || memcmp(out, reference, frames * CHANNELS * sizeof(int32_t))) {
+					printf("%s: differs with calls of %zu frames, checkpoint at %g s\n",
+						signals[i].name, calls[c], seconds);
+					differs = 1;
+				}
+				else if (!same_stats(&stats, &reference_stats)) {
+					printf("%s: other counters with calls of %zu frames, checkpoint at %g s\n",
+						signals[i].name, calls[c], seconds);
+					differs = 1;
+				}
+			}
+		if (!differs) for (c = 0; c < sizeof(budgets) / sizeof(budgets[0]); c++) {
+			memset(out, 0, frames * CHANNELS * sizeof(int32_t));
+			produced = run(in, frames, out, calls[0], 0, budgets[c], file_name, &stats);
+			if (produced != frames || memcmp(out, reference, frames * CHANNELS * sizeof(int32_t))) {
+				printf("%s: differs with a budget of %zu samples\n", signals[i].name, budgets[c]);
+				differs = 1;
+			}
+		}
+		printf("%s: %s, %" PRIu64 " forced slices\n", signals[i].name, differs ? "FAILED" : "same output", reference_stats.forced);
+		failed |= differs;
+		free(in);
+		free(reference);
+		free(out);
+	}
+	if (failed) printf("Outputs depend on the calls\n");
+	failed |= check_fixed();
+
+	return failed;
+}
@@ -0,0 +1,139 @@
+/*
+    WAV files for the limiter tools
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIMITER_WAV_H
+#define LIMITER_WAV_H
+
+/*
+	Just enough of RIFF WAVE for the limiter tools: PCM and float
+	samples are found in any WAV file, a canonical header is written.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "limiter.h"
+
+#define WAV_HEADER_SIZE 44	/* Canonical header, written for every output */
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+typedef struct {
+	int wav;				/* RIFF WAVE, otherwise RAW */
+	unsigned int rate;
+	unsigned int channels;
+	unsigned int bits;
+	int is_float;
+	size_t data_offset;		/* In bytes from the start of the file */
+	size_t data_size;		/* In bytes, whole frames only */
+} audio_format_t;
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | p[1] << 8);
+}
+static inline void put_le32(uint8_t *p, const uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+static inline void put_le16(uint8_t *p, const uint16_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+/*
+	Find the fmt and data chunks of a RIFF WAVE file,
+	a data size bigger than the file (streamed WAV) is cut to the file
+	Returns -1 if the file is not a WAV file we can handle
+*/
+static inline int parse_wav(const uint8_t *map, const size_t size, audio_format_t *format)
+{
+	size_t offset = 12, chunk;
+	int have_fmt = 0;
+	unsigned int tag;
+
+	if (size < 12 || memcmp(map, "RIFF", 4) || memcmp(map + 8, "WAVE", 4)) return -1;
+
+	while (offset + 8 <= size) {
+		chunk = get_le32(map + offset + 4);
+		if (!memcmp(map + offset, "fmt ", 4)) {
+			if (chunk < 16 || offset + 8 + chunk > size) return -1;
+			tag = get_le16(map + offset + 8);
+			if (tag == WAV_FORMAT_EXTENSIBLE && chunk >= 26) tag = get_le16(map + offset + 32);
+			format->channels = get_le16(map + offset + 10);
+			format->rate = get_le32(map + offset + 12);
+			format->bits = get_le16(map + offset + 22);
+			format->is_float = tag == WAV_FORMAT_FLOAT;
+			if (tag != WAV_FORMAT_PCM && tag != WAV_FORMAT_FLOAT) return -1;
+			have_fmt = 1;
+		} else if (!memcmp(map + offset, "data", 4)) {
+			if (!have_fmt) return -1;
+			format->wav = 1;
+			format->data_offset = offset + 8;
+			format->data_size = chunk < size - format->data_offset ? chunk : size - format->data_offset;
+			return 0;
+		}
+		/* Chunks are word aligned */
+		offset += 8 + chunk + (chunk & 1);
+	}
+	return -1;
+}
+
+static inline void write_wav_header(uint8_t *p, const audio_format_t *format)
+{
+	const unsigned int block_align = format->channels * format->bits / 8;
+
+	memcpy(p, "RIFF", 4);
+	put_le32(p + 4, WAV_HEADER_SIZE - 8 + format->data_size);
+	memcpy(p + 8, "WAVEfmt ", 8);
+	put_le32(p + 16, 16);
+	put_le16(p + 20, format->is_float ? WAV_FORMAT_FLOAT : WAV_FORMAT_PCM);
+	put_le16(p + 22, format->channels);
+	put_le32(p + 24, format->rate);
+	put_le32(p + 28, format->rate * block_align);
+	put_le16(p + 32, block_align);
+	put_le16(p + 34, format->bits);
+	memcpy(p + 36, "data", 4);
+	put_le32(p + 40, format->data_size);
+}
+
+static inline int sample_format(const audio_format_t *format, limiter_format_t *result)
+{
+	if (format->is_float) {
+		if (format->bits != 32) return -1;
+		*result = LIMITER_FORMAT_FLOAT;
+		return 0;
+	}
+	switch (format->bits) {
+		case 16: *result = LIMITER_FORMAT_S16; return 0;
+		case 24: *result = LIMITER_FORMAT_S24; return 0;
+		case 32: *result = LIMITER_FORMAT_S32; return 0;
+	}
+	return -1;
+}
+
+#endif
@@ -0,0 +1,320 @@
+/*
+    LibSox limiter
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Zero crossing limiter, without SoX: limiter.c is the SoX effect
+	built on it, limiter_core.c is all that is needed to embed it.
+	Input is cut in slices at the zero crossings of the first channel,
+	a slice louder than the threshold is lowered as a whole, so the
+	output lags the input by the longest slice seen (the lookahead).
+*/
+typedef struct limiter limiter_t;
+
+#define LIMITER_LOOKAHEAD_DEFAULT 2.0f	/* in seconds */
+#define LIMITER_LOOKAHEAD_MIN 0.05f		/* in seconds, also the initial buffer, it grows on demand */
+#define LIMITER_LOOKAHEAD_MAX 60.0f		/* in seconds */
+#define LIMITER_THRESHOLD_MIN -40.0f	/* in dB, the maximum is 0 */
+
+/* Sample format of the buffers, always interleaved */
+typedef enum {
+	LIMITER_FORMAT_S32,		/* 32 bit signed integers, as sox_sample_t */
+	LIMITER_FORMAT_FLOAT,	/* Floats, full scale is 1, louder input is clipped */
+	LIMITER_FORMAT_S16,		/* 16 bit signed integers */
+	LIMITER_FORMAT_S24		/* 24 bit signed integers packed in 3 bytes, little endian as in WAV files */
+} limiter_format_t;
+
+/* Message levels */
+enum {
+	LIMITER_MESSAGE_REPORT,	/* Statistics, see limiter_report() */
+	LIMITER_MESSAGE_WARN,
+	LIMITER_MESSAGE_DEBUG
+};
+
+/*
+	Strings are not copied, they must be valid until limiter_destroy()
+*/
+typedef struct {
+	float threshold_db;		/* From LIMITER_THRESHOLD_MIN to 0 */
+	double rate;			/* In Hz */
+	unsigned int channels;	/* Only 2 channels are supported */
+	limiter_format_t format;
+	float max_lookahead;	/* In seconds, from LIMITER_LOOKAHEAD_MIN to LIMITER_LOOKAHEAD_MAX */
+	const char *stats_file;	/* JSON statistics report written by limiter_destroy(), NULL if not requested */
+	int counters;			/* Read the hardware performance counters */
+	const char *meter_name;	/* Shared memory name of the live meter, starting with /, NULL if not requested */
+	int channel_stats;		/* Collect per channel statistics */
+	const char *capture_name;	/* Workload capture file name, NULL if not requested */
+	int realtime;			/* Allocate the whole lookahead at once, see limiter_process_fixed() */
+	size_t work_budget;		/* Samples searched and limited at most per call, 0 for no limit, see below */
+	void (*message)(int level, const char *text, void *data);	/* Messages are dropped if NULL */
+	void *message_data;		/* Passed to message */
+} limiter_config_t;
+
+/* Current state, see limiter_get_stats() */
+typedef struct {
+	float threshold_db;
+	double gain;			/* Gain applied to the last slice */
+	double min_gain;		/* Minimum gain applied so far */
+	uint64_t actions;		/* Number of limited slices */
+	uint64_t slices;		/* Number of slices */
+	uint64_t forced;		/* Number of slices forced on a full buffer */
+	uint64_t overruns;		/* Calls that used all of the work budget */
+	uint64_t clipped;		/* Frames clipped because the work budget was used */
+	size_t buffered;		/* Frames in the lookahead buffer */
+	size_t size;			/* Size of the lookahead buffer in frames */
+} limiter_stats_t;
+
+/* Default configuration: 0 dB, 2 channels at 44100 Hz, 32 bit integers, nothing optional */
+void limiter_config_init(limiter_config_t *config);
+
+/* Returns the description of the first invalid setting, NULL if config is valid */
+const char *limiter_config_check(const limiter_config_t *config);
+
+/*
+	Highest magnitude of count samples, full scale is 1. Done on a whole
+	signal it tells limiter_bypass() whether the limiter is needed at all.
+*/
+double limiter_peak(const void *samples, size_t count, limiter_format_t format);
+
+/*
+	Returns 1 if a signal with this peak (full scale is 1), known or from
+	limiter_peak(), comes out of the limiter unchanged at threshold_db:
+	no slice can be over the threshold, the limiter can be skipped.
+	A peak over 1 (floats) always needs the limiter.
+*/
+int limiter_bypass(float threshold_db, double peak);
+
+/* Returns NULL if config is not valid or the lookahead buffer can't be allocated */
+limiter_t *limiter_create(const limiter_config_t *config);
+
+/*
+	Consume up to *in_frames frames from in and produce up to *out_frames
+	frames in out, the frames consumed and produced are returned in the
+	same variables. Output is produced only when the slice is complete,
+	slices completed by this input are produced in the same call.
+	Returns 0 on success, -1 on error
+*/
+int limiter_process(limiter_t *l, const void *in, size_t *in_frames, void *out, size_t *out_frames);
+
+/*
+	After the last input: the data left is limited with the current gain,
+	up to *out_frames frames are produced, call it again until *out_frames is 0
+	Returns 0 on success, -1 on error
+*/
+int limiter_flush(limiter_t *l, void *out, size_t *out_frames);
+
+/*
+	Work budget: with config.work_budget set, limiter_process(),
+	limiter_input_commit() and limiter_process_fixed() stop searching and
+	limiting slices when they have gone through that many samples, the
+	rest is done by the next calls. Frames that must be output (a forced
+	slice) when the budget is used are clipped to the threshold instead,
+	a single cheap pass. limiter_flush() and limiter_finish() have no budget.
+*/
+
+/*
+	Fixed latency processing for realtime hosts, needs config.realtime:
+	frames frames are consumed from in and as many are produced in out,
+	delayed by limiter_latency() frames. A slice not complete when its
+	first frame is due is forced. The buffer is never resized, it is
+	locked in memory and filled with silence by limiter_create() and
+	limiter_reset(). Without stats_file, counters, meter_name and
+	capture_name there is no allocation, lock, system call or page fault,
+	and the time taken is bounded.
+	Returns 0 on success, -1 without config.realtime
+*/
+int limiter_process_fixed(limiter_t *l, const void *in, void *out, size_t frames);
+
+/* Delay of limiter_process_fixed() in frames, the lookahead buffer size */
+size_t limiter_latency(const limiter_t *l);
+
+/*
+	Zero copy access to the lookahead buffer, for LIMITER_FORMAT_S32 only,
+	instead of limiter_process() and limiter_flush():
+	limiter_input_region() returns where up to *frames new frames can be
+	written (the buffer grows if they don't fit, fewer frames may be
+	returned, NULL for other formats), limiter_input_commit() slices the
+	frames written there. limiter_output_region() returns the frames ready
+	for output, they stay in the buffer until limiter_output_release().
+	limiter_finish() limits the data left after the last input.
+	Regions are contiguous, they are valid until the next call
+	that can change the buffer: limiter_input_region() or limiter_input_commit().
+*/
+void *limiter_input_region(limiter_t *l, size_t *frames);
+int limiter_input_commit(limiter_t *l, size_t frames);
+const void *limiter_output_region(const limiter_t *l, size_t *frames);
+int limiter_output_release(limiter_t *l, size_t frames);
+void limiter_finish(limiter_t *l);
+
+/*
+	Forget the signal to start a new one, keeping the lookahead buffer at its
+	current size: cheaper than limiter_destroy() and limiter_create().
+	Statistics keep counting.
+*/
+void limiter_reset(limiter_t *l);
+
+/* Change the threshold from the next slice, returns -1 if it is out of range */
+int limiter_set_threshold(limiter_t *l, float threshold_db);
+
+void limiter_get_stats(const limiter_t *l, limiter_stats_t *stats);
+
+/*
+	Save the signal state between two calls: the lookahead buffer contents,
+	the gain, the threshold, the counters and the statistics. position is
+	kept with it for the caller, usually the input frames consumed so far.
+	A limiter created with the same rate, channels, format and lookahead
+	and restored from the checkpoint produces the same output the saved one
+	would have produced.
+	The file is replaced atomically, it is synced before the rename.
+	Not for the zero copy regions while output frames are not released,
+	nor for a limiter with config.realtime, whose buffer is always full
+	(of silence after limiter_create() and limiter_reset()): it returns -1.
+	Returns 0 on success, -1 on error
+*/
+int limiter_checkpoint(const limiter_t *l, const char *file_name, uint64_t position);
+
+/*
+	Restore a checkpoint in a limiter that has processed nothing yet,
+	or after limiter_reset(), *position is set to the saved position.
+	Not for a limiter with config.realtime, see limiter_checkpoint().
+	Returns -1 if the file can't be read or the configuration differs
+*/
+int limiter_restore(limiter_t *l, const char *file_name, uint64_t *position);
+
+/* Send the statistics report to the message callback, a line at a time */
+void limiter_report(limiter_t *l);
+
+/* The statistics file and the workload capture are written here */
+void limiter_destroy(limiter_t *l);
+
+/*
+	Process wide limit for the lookahead memory of all limiter instances,
+	in bytes, 0 means no limit.
+	If not set, it is read from the LIMITER_MEMORY_BUDGET environment variable.
+	Instances started over the budget get a smaller lookahead.
+*/
+void limiter_set_memory_budget(size_t bytes);
+size_t limiter_get_memory_budget(void);
+
+/* Lookahead memory currently used by all limiter instances, in bytes */
+size_t limiter_get_memory_used(void);
+
+/*
+	Live meter published by the limiter in a shared memory segment
+	(shm_open name given with -m), updated once per limiter_process() call.
+	The limiter increments sequence before and after writing, so it is odd
+	during an update: readers copy the data, then check that sequence was
+	even and did not change, see limiter_meter_read().
+	The segment also carries a control block written by other processes:
+	the limiter checks control_sequence at the start of each limiter_process() call,
+	see limiter_meter_set_threshold().
+*/
+#define LIMITER_METER_MAGIC 0x524d4c4c	/* "LLMR" */
+#define LIMITER_METER_VERSION 2	/* 2 added the control block */
+
+typedef struct {
+	uint32_t magic;			/* LIMITER_METER_MAGIC */
+	uint32_t version;		/* LIMITER_METER_VERSION */
+	uint32_t sequence;		/* Odd while the limiter is writing */
+	uint32_t channels;
+	double rate;
+	double threshold_db;	/* Current threshold */
+	double gain;			/* Gain applied to the last slice */
+	double min_gain;		/* Minimum gain applied so far */
+	uint64_t actions;		/* Number of limited slices */
+	uint64_t slices;		/* Number of slices */
+	uint64_t forced;		/* Number of slices forced on a full buffer */
+	uint64_t fill;			/* Samples in the lookahead buffer */
+	uint64_t size;			/* Size of the lookahead buffer in samples */
+	uint64_t flows;			/* Number of limiter_process() calls */
+	uint32_t control_sequence;	/* Incremented after each change of the control block */
+	int32_t threshold_request;	/* Threshold to apply, in hundredths of dB, from -4000 to 0 */
+} limiter_meter_t;
+
+/*
+	Take a consistent copy of the meter, without locks or syscalls
+	Returns 0 on success, -1 if the limiter kept writing
+*/
+static inline int limiter_meter_read(const limiter_meter_t *meter, limiter_meter_t *copy)
+{
+	uint32_t before, after;
+	int tries;
+
+	for (tries = 0; tries < 1000; ++tries) {
+		before = __atomic_load_n(&meter->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) continue;
+		*copy = *meter;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&meter->sequence, __ATOMIC_RELAXED);
+		if (before == after) return 0;
+	}
+	return -1;
+}
+
+/*
+	Ask the limiter to change its threshold, it is applied at the next
+	limiter_process() call, starting from the first slice not processed yet
+	Returns -1 if the threshold is out of range
+*/
+static inline int limiter_meter_set_threshold(limiter_meter_t *meter, double threshold_db)
+{
+	if (threshold_db > 0 || threshold_db < -40) return -1;
+	__atomic_store_n(&meter->threshold_request, (int32_t)(threshold_db * 100 + (threshold_db < 0 ? -0.5 : 0.5)),
+		__ATOMIC_RELAXED);
+	__atomic_fetch_add(&meter->control_sequence, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+	Workload capture written with -c: the call pattern and the slices,
+	no audio. All numbers are unsigned LEB128 varints.
+	Header: LIMITER_CAPTURE_MAGIC (8 bytes), version, rate (Hz), channels,
+	threshold (hundredths of dB below full scale), max lookahead (ms).
+	Then records, each one a tag byte followed by its numbers:
+	LIMITER_CAPTURE_FLOW: samples offered, output room, samples consumed, samples produced
+	LIMITER_CAPTURE_SLICE: length (frames), peak (absolute sample value)
+	LIMITER_CAPTURE_DRAIN: output room, samples produced
+	LIMITER_CAPTURE_END: nothing, the last record
+*/
+#define LIMITER_CAPTURE_MAGIC "LIMCAPT\n"
+#define LIMITER_CAPTURE_VERSION 1
+#define LIMITER_CAPTURE_FLOW 'F'
+#define LIMITER_CAPTURE_SLICE 'S'
+#define LIMITER_CAPTURE_DRAIN 'D'
+#define LIMITER_CAPTURE_END 'E'
+
+/*
+	Checkpoint written by limiter_checkpoint(), for the same build only:
+	LIMITER_CHECKPOINT_MAGIC (8 bytes), then as LEB128 varints version,
+	rate (Hz), channels, format, max lookahead (ms), position, actions,
+	slices, forced, overruns, clipped frames, samples in the buffer,
+	processed samples, samples searched, then threshold (dB), gain and
+	minimum gain as native doubles, the input and output channel
+	statistics and the report statistics as native structures and the
+	samples as native 32 bit integers.
+*/
+#define LIMITER_CHECKPOINT_MAGIC "LIMCKPT\n"
+#define LIMITER_CHECKPOINT_VERSION 2
+
+#endif
@@ -0,0 +1,2082 @@
+/*
+    Limiter core
+    Copyright (C) 2013 Guido Aulisi guido.aulisi@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* mremap(), memfd_create(), where they exist */
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+/* USDT probes for bpftrace and systemtap, a single nop each when nobody is attached */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifdef DTRACE_PROBE3
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(limiter, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(limiter, name, a1, a2, a3)
+#else
+#define PROBE2(name, a1, a2) do { } while (0)
+#define PROBE3(name, a1, a2, a3) do { } while (0)
+#endif
+
+#include "limiter.h"
+
+typedef int32_t sample_t;	/* Same as sox_sample_t */
+#define SAMPLE_MAX ((sample_t)0x7fffffff)
+#define SAMPLE_MIN (-SAMPLE_MAX - 1)
+
+#ifndef min
+#define min(a, b) ((a) <= (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) >= (b) ? (a) : (b))
+#endif
+
+#define SHRINK_WINDOW 256	/* limiter_process() calls observed before trying to shrink the buffer */
+#define NUMBER_OF_CHANNELS 2 /* TESTED ONLY WITH 2 CHANNELS */
+#define MESSAGE_SIZE 256	/* Longest message, including the terminator */
+#define METER_PATH_SIZE 300	/* /dev/shm and the longest meter name, NAME_MAX is 255 */
+
+#define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
+#define CO_DB(v) (20.0f * log10f(v))
+
+#define LENGTH_BUCKETS 32		/* Power of two buckets, in frames */
+#define REDUCTION_BUCKETS 48	/* 1 dB buckets, the last one collects everything above */
+
+/* Define ZERO_CROSSING_CHECK_OTHER_CHANNELS if you want to check the other channel(s) for ZERO CROSSING detection */
+#define ZERO_CROSSING_CHECK_OTHER_CHANNELS
+/* If checking the other channels(s), they must be less than this values to be a ZERO CROSSING (-40 dB) */
+static const sample_t MAX_ZERO_CROSSING_VALUE = (0.01f * SAMPLE_MAX);
+
+/* Define LIMITER_PROFILE if you want cycle counters for each stage of the slice engine in the report */
+/* #define LIMITER_PROFILE */
+#ifdef LIMITER_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK() __rdtsc()
+#define PROFILE_UNIT "cycles"
+#else
+#define PROFILE_CLOCK() now_ns()
+#define PROFILE_UNIT "ns"
+#endif
+enum {
+	PROFILE_CROSSING,
+	PROFILE_PEAK,
+	PROFILE_GAIN,
+	PROFILE_COPY_IN,
+	PROFILE_COPY_OUT,
+	PROFILES
+};
+static const char * const profile_names[PROFILES] = {"crossing search", "peak search", "gain", "copy in", "copy out"};
+#define PROFILE_DECLARE uint64_t profile_clock = 0
+#define PROFILE_START() (profile_clock = PROFILE_CLOCK())
+#define PROFILE_STOP(l, stage) ((l)->profile_cycles[stage] += PROFILE_CLOCK() - profile_clock, ++((l)->profile_calls[stage]))
+#else
+#define PROFILE_DECLARE
+#define PROFILE_START()
+#define PROFILE_STOP(l, stage)
+#endif
+
+/* Process wide lookahead memory budget, shared by all limiter instances */
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static int budget_initialized = 0;	/* The budget was set by the API or the environment */
+static size_t budget_limit = 0;		/* In bytes, 0 means no limit */
+static size_t budget_used = 0;		/* In bytes */
+
+// Ring buffer
+typedef struct {
+	sample_t *data;
+	size_t size;			/* Total size of buffer in samples */
+	size_t available;		/* Number of samples in the buffer */
+	size_t processed;		/* Number of sample already processede, must be < available */
+	sample_t *position;	/* Audio buffer actual position */
+	size_t min_size;		/* The buffer never shrinks below this size in samples */
+	size_t max_size;		/* The buffer never grows above this size in samples */
+	int fd;					/* Backing file, needed to remap the buffer */
+} ring_buffer_t;
+
+/* Stages timed for the statistics report */
+enum {
+	STAGE_COPY_OUT,
+	STAGE_COPY_IN,
+	STAGE_PROCESS,
+	STAGE_RESIZE,
+	STAGES
+};
+static const char * const stage_names[STAGES] = {"copy_out", "copy_in", "process", "resize"};
+
+typedef struct {
+	uint64_t slice_length[LENGTH_BUCKETS];		/* Bucket n counts slices from 2^n to 2^(n+1)-1 frames */
+	uint64_t gain_reduction[REDUCTION_BUCKETS];	/* Bucket n counts limited slices from n to n+1 dB */
+	uint64_t fill_level[LENGTH_BUCKETS];		/* Frames in the buffer after each process call, as slice_length */
+	uint64_t time[STAGES];						/* Nanoseconds spent in each stage */
+	uint64_t flows;								/* Number of limiter_process() calls */
+	uint64_t drains;							/* Number of limiter_flush() calls */
+	size_t max_buffer_size;						/* Biggest lookahead buffer used, in samples */
+} statistics_t;
+
+/* Hardware performance counters, read around limiter_process() and limiter_flush() */
+enum {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_LLC_MISSES,
+	COUNTER_DTLB_MISSES,
+	COUNTERS
+};
+static const char * const counter_names[COUNTERS] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+
+typedef struct {
+	int enabled;				/* Requested by the user */
+	int fd[COUNTERS];			/* fd[COUNTER_CYCLES] is the group leader, -1 if not available */
+	uint64_t samples;			/* Samples consumed and drained while counting */
+} hw_counters_t;
+
+/* Per channel statistics of the input or the output */
+typedef struct {
+	double sum[NUMBER_OF_CHANNELS];			/* For the DC offset */
+	double sum_squares[NUMBER_OF_CHANNELS];	/* For the RMS level */
+	sample_t min[NUMBER_OF_CHANNELS];
+	sample_t max[NUMBER_OF_CHANNELS];
+	uint64_t clips[NUMBER_OF_CHANNELS];		/* Samples at full scale */
+	uint64_t frames;
+} channel_stats_t;
+
+struct limiter {
+	limiter_config_t config;	/* As given to limiter_create() */
+	sample_t threshold;	/* Max level */
+	double gain;			/* Current gain */
+	ring_buffer_t *rbuffer;	/* Audio buffer */
+	uint64_t actions;		/* Number of limiter actions */
+	uint64_t slices;		/* Number of slices found by the zero crossing detector */
+	double min_gain;		/* Minimun gain applied */
+	float max_lookahead;	/* Maximum lookahead time in seconds */
+	size_t fill_peak;		/* Max samples in the buffer during the current shrink window */
+	unsigned int flows;		/* limiter_process() calls in the current shrink window */
+	uint64_t forced;		/* Number of slices forced on a full buffer */
+	float threshold_db;		/* Threshold as requested, for the statistics report */
+	const char *stats_file;	/* JSON statistics report, NULL if not requested */
+	statistics_t stats;		/* Collected only if stats_file is set */
+	hw_counters_t counters;	/* Hardware counters */
+	const char *meter_name;	/* Shared memory name of the live meter, NULL if not requested */
+	limiter_meter_t *meter;	/* Live meter */
+	uint32_t control_sequence;	/* Last control block change applied */
+	int channel_stats;		/* Collect per channel statistics */
+	channel_stats_t input;	/* Per channel statistics of the input */
+	channel_stats_t output;	/* Per channel statistics of the output */
+	const char *capture_name;	/* Workload capture file name, NULL if not requested */
+	FILE *capture;			/* Workload capture */
+	size_t released;		/* Samples released by limiter_output_release() since the last commit */
+	size_t scanned;			/* Unprocessed samples already searched for a zero crossing, without success */
+	size_t work;			/* Work budget left in the current call, in samples */
+	int sliced;				/* A slice was limited in the current call */
+	uint64_t overruns;		/* Calls that used all of the work budget */
+	uint64_t clipped;		/* Frames clipped because the work budget was used */
+#ifdef LIMITER_PROFILE
+	uint64_t profile_cycles[PROFILES];	/* Clock ticks spent in each stage */
+	uint64_t profile_calls[PROFILES];	/* Number of times each stage was run */
+#endif
+};
+
+/* Format a message and pass it to the callback of the configuration */
+static void message(const limiter_t* const l, const int level, const char *format, ...)
+{
+	char text[MESSAGE_SIZE];
+	va_list args;
+
+	if (!l->config.message) return;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	l->config.message(level, text, l->config.message_data);
+}
+
+/*
+	Open the hardware counters for the calling thread, as a group so they
+	count the same instructions. Counters not supported by the CPU, the
+	kernel or the permissions are left out silently.
+*/
+static void counters_open(const limiter_t* const l, hw_counters_t* const counters)
+{
+	int i;
+#ifdef __linux__
+	struct perf_event_attr attr;
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+	};
+#endif
+
+	counters->samples = 0;
+	for (i = 0; i < COUNTERS; ++i) counters->fd[i] = -1;
+	if (!counters->enabled) return;
+
+#ifdef __linux__
+	for (i = 0; i < COUNTERS; ++i) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.disabled = (i == COUNTER_CYCLES);	/* The leader starts the group */
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counters->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+			i == COUNTER_CYCLES ? -1 : counters->fd[COUNTER_CYCLES], PERF_FLAG_FD_CLOEXEC);
+		if (i == COUNTER_CYCLES && counters->fd[i] < 0) {
+			message(l, LIMITER_MESSAGE_DEBUG, "Hardware counters not available");
+			return;
+		}
+	}
+#endif
+}
+static void counters_enable(const hw_counters_t* const counters, const int enable)
+{
+#ifdef __linux__
+	if (counters->fd[COUNTER_CYCLES] >= 0)
+		ioctl(counters->fd[COUNTER_CYCLES],
+			enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#else
+	(void)counters;
+	(void)enable;
+#endif
+}
+/*
+	Read the counters, unavailable counters read as 0
+	Returns 0 if no counter was available
+*/
+static int counters_read(const hw_counters_t* const counters, uint64_t values[COUNTERS])
+{
+	int i, result = 0;
+
+	for (i = 0; i < COUNTERS; ++i) {
+		values[i] = 0;
+		if (counters->fd[i] < 0) continue;
+		if (read(counters->fd[i], &values[i], sizeof(values[i])) == sizeof(values[i])) result = 1;
+	}
+	return result;
+}
+static void counters_close(hw_counters_t* const counters)
+{
+	int i;
+
+	for (i = 0; i < COUNTERS; ++i) {
+		if (counters->fd[i] >= 0) close(counters->fd[i]);
+		counters->fd[i] = -1;
+	}
+}
+
+/*
+	shm_open() and shm_unlink() are in librt before glibc 2.34, on Linux
+	the segment is opened in /dev/shm as glibc does, so the core links
+	without it (libsox doesn't link librt). Returns -1 on error
+*/
+#ifdef __linux__
+static int meter_path(const char *name, char *path, const size_t size)
+{
+	const int length = snprintf(path, size, "/dev/shm%s", name);
+
+	return length < 0 || (size_t)length >= size ? -1 : 0;
+}
+#endif
+static int meter_shm_open(const char *name)
+{
+#ifdef __linux__
+	char path[METER_PATH_SIZE];
+
+	if (meter_path(name, path, sizeof(path)) < 0) return -1;
+	return open(path, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+#else
+	return shm_open(name, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+#endif
+}
+static void meter_shm_unlink(const char *name)
+{
+#ifdef __linux__
+	char path[METER_PATH_SIZE];
+
+	if (meter_path(name, path, sizeof(path)) == 0) unlink(path);
+#else
+	shm_unlink(name);
+#endif
+}
+
+/*
+	Create the shared memory segment of the live meter
+	Returns NULL on error
+*/
+static limiter_meter_t *meter_open(const char *name)
+{
+	int fd;
+	limiter_meter_t *meter;
+
+	fd = meter_shm_open(name);
+	if (fd < 0) return NULL;
+	if (ftruncate(fd, sizeof(limiter_meter_t)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	meter = mmap(NULL, sizeof(limiter_meter_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, (off_t)0);
+	close(fd);
+	if (meter == MAP_FAILED) return NULL;
+
+	memset(meter, 0, sizeof(limiter_meter_t));
+	meter->magic = LIMITER_METER_MAGIC;
+	meter->version = LIMITER_METER_VERSION;
+	return meter;
+}
+static void meter_close(limiter_meter_t *meter, const char *name)
+{
+	if (!meter) return;
+	munmap(meter, sizeof(limiter_meter_t));
+	/* Readers still attached keep the last values */
+	meter_shm_unlink(name);
+}
+
+/*
+	Publish the current state in the live meter, the sequence is odd
+	while the fields are written
+*/
+static void meter_update(limiter_t* const l)
+{
+	limiter_meter_t *meter = l->meter;
+	const uint32_t sequence = meter->sequence;
+
+	__atomic_store_n(&meter->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	meter->threshold_db = l->threshold_db;
+	meter->gain = l->gain;
+	meter->min_gain = l->min_gain;
+	meter->actions = l->actions;
+	meter->slices = l->slices;
+	meter->forced = l->forced;
+	meter->fill = l->rbuffer->available;
+	meter->size = l->rbuffer->size;
+	++(meter->flows);
+	__atomic_store_n(&meter->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void channel_stats_reset(channel_stats_t* const stats)
+{
+	unsigned int c;
+
+	memset(stats, 0, sizeof(channel_stats_t));
+	for (c = 0; c < NUMBER_OF_CHANNELS; ++c) {
+		stats->min[c] = SAMPLE_MAX;
+		stats->max[c] = SAMPLE_MIN;
+	}
+}
+static void channel_stats_add(channel_stats_t* const total, const channel_stats_t* const part)
+{
+	unsigned int c;
+
+	for (c = 0; c < NUMBER_OF_CHANNELS; ++c) {
+		total->sum[c] += part->sum[c];
+		total->sum_squares[c] += part->sum_squares[c];
+		total->min[c] = min(total->min[c], part->min[c]);
+		total->max[c] = max(total->max[c], part->max[c]);
+		total->clips[c] += part->clips[c];
+	}
+	total->frames += part->frames;
+}
+/*
+	Accumulate statistics of whole frames from begin to end, if apply is set
+	the samples are multiplied by gain first and the result is accounted.
+	Every channel has its own accumulators, so the loop can be vectorized.
+*/
+static void channel_stats_scan(channel_stats_t* const stats, sample_t *begin, const sample_t *end,
+	const int apply, const double gain)
+{
+	sample_t *frame;
+	sample_t value;
+	unsigned int c;
+	int64_t sum[NUMBER_OF_CHANNELS] = {0};	/* Exact within a slice */
+	double sum_squares[NUMBER_OF_CHANNELS] = {0};
+	sample_t low[NUMBER_OF_CHANNELS], high[NUMBER_OF_CHANNELS];
+	uint64_t clips[NUMBER_OF_CHANNELS] = {0};
+
+	for (c = 0; c < NUMBER_OF_CHANNELS; ++c) {
+		low[c] = stats->min[c];
+		high[c] = stats->max[c];
+	}
+	for (frame = begin; frame < end; frame += NUMBER_OF_CHANNELS)
+		for (c = 0; c < NUMBER_OF_CHANNELS; ++c) {
+			if (apply) frame[c] = (double)frame[c] * gain;
+			value = frame[c];
+			sum[c] += value;
+			sum_squares[c] += (double)value * value;
+			low[c] = value < low[c] ? value : low[c];
+			high[c] = value > high[c] ? value : high[c];
+			clips[c] += (value == SAMPLE_MAX) | (value == SAMPLE_MIN);
+		}
+	for (c = 0; c < NUMBER_OF_CHANNELS; ++c) {
+		stats->sum[c] += sum[c];
+		stats->sum_squares[c] += sum_squares[c];
+		stats->min[c] = low[c];
+		stats->max[c] = high[c];
+		stats->clips[c] += clips[c];
+	}
+	stats->frames += (end - begin) / NUMBER_OF_CHANNELS;
+}
+
+/* Write an unsigned LEB128 number to the workload capture */
+static void capture_number(FILE *f, uint64_t value)
+{
+	while (value >= 0x80) {
+		putc((int)(value & 0x7f) | 0x80, f);
+		value >>= 7;
+	}
+	putc((int)value, f);
+}
+static void capture_record(FILE *f, const int tag, const unsigned int count,
+	const uint64_t a, const uint64_t b, const uint64_t c, const uint64_t d)
+{
+	putc(tag, f);
+	capture_number(f, a);
+	capture_number(f, b);
+	if (count > 2) capture_number(f, c);
+	if (count > 3) capture_number(f, d);
+}
+static FILE *capture_open(const char *name, const limiter_t* const l)
+{
+	FILE *f;
+
+	if (!(f = fopen(name, "wb"))) return NULL;
+	fputs(LIMITER_CAPTURE_MAGIC, f);
+	capture_number(f, LIMITER_CAPTURE_VERSION);
+	capture_number(f, l->config.rate);
+	capture_number(f, NUMBER_OF_CHANNELS);
+	capture_number(f, -l->threshold_db * 100 + 0.5f);
+	capture_number(f, l->max_lookahead * 1000 + 0.5f);
+	return f;
+}
+
+/*
+	Apply a threshold change requested in the meter control block,
+	only a few loads if nothing changed
+*/
+static void meter_control(limiter_t* const l)
+{
+	const uint32_t sequence = __atomic_load_n(&l->meter->control_sequence, __ATOMIC_ACQUIRE);
+	int32_t request;
+
+	if (sequence == l->control_sequence) return;
+	l->control_sequence = sequence;
+
+	request = __atomic_load_n(&l->meter->threshold_request, __ATOMIC_RELAXED);
+	if (request > 0 || request < -4000) return;
+	limiter_set_threshold(l, request / 100.0f);
+}
+
+/* Histogram bucket of a positive value, floor(log2(value)) */
+static unsigned int log2_bucket(uint64_t value)
+{
+	unsigned int bucket = 0;
+
+	while (value >>= 1) ++bucket;
+	return min(bucket, LENGTH_BUCKETS - 1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*
+	Account the time elapsed since *clock to stage and restart the clock,
+	only if the statistics report is requested
+*/
+static void stage_done(limiter_t* const l, const int stage, uint64_t *clock)
+{
+	uint64_t now;
+
+	if (!l->stats_file) return;
+	now = now_ns();
+	l->stats.time[stage] += now - *clock;
+	*clock = now;
+}
+
+/*
+	Read the budget from LIMITER_MEMORY_BUDGET if the API didn't set it,
+	the value is in bytes with an optional k, M or G suffix.
+	Call with budget_lock held.
+*/
+static void budget_init(void)
+{
+	const char *env;
+	double value;
+	char suffix = 0;
+
+	if (budget_initialized) return;
+	budget_initialized = 1;
+
+	if (!(env = getenv("LIMITER_MEMORY_BUDGET"))) return;
+	if (sscanf(env, "%lf%c", &value, &suffix) < 1 || value < 0) return;
+	switch (suffix) {
+		case 'G': value *= 1024;
+		/* Falls through */
+		case 'M': value *= 1024;
+		/* Falls through */
+		case 'k': value *= 1024;
+		/* Falls through */
+		case 0: break;
+		default: return;
+	}
+	budget_limit = value;
+}
+/*
+	Reserve up to bytes of lookahead memory, rounded down to a multiple of unit.
+	At least minimum bytes are always granted, even over the budget, so every
+	instance can run with a minimal buffer.
+	Returns the reserved size
+*/
+static size_t budget_reserve(const size_t bytes, const size_t minimum, const size_t unit)
+{
+	size_t granted = bytes;
+
+	pthread_mutex_lock(&budget_lock);
+	budget_init();
+	if (budget_limit > 0) {
+		granted = budget_used < budget_limit ? budget_limit - budget_used : 0;
+		granted -= granted % unit;
+		if (granted > bytes) granted = bytes;
+		if (granted < minimum) granted = minimum;
+	}
+	budget_used += granted;
+	pthread_mutex_unlock(&budget_lock);
+
+	return granted;
+}
+static void budget_release(const size_t bytes)
+{
+	pthread_mutex_lock(&budget_lock);
+	budget_used -= min(bytes, budget_used);
+	pthread_mutex_unlock(&budget_lock);
+}
+
+void limiter_set_memory_budget(size_t bytes)
+{
+	pthread_mutex_lock(&budget_lock);
+	budget_initialized = 1;
+	budget_limit = bytes;
+	pthread_mutex_unlock(&budget_lock);
+}
+size_t limiter_get_memory_budget(void)
+{
+	size_t result;
+
+	pthread_mutex_lock(&budget_lock);
+	budget_init();
+	result = budget_limit;
+	pthread_mutex_unlock(&budget_lock);
+
+	return result;
+}
+size_t limiter_get_memory_used(void)
+{
+	size_t result;
+
+	pthread_mutex_lock(&budget_lock);
+	result = budget_used;
+	pthread_mutex_unlock(&budget_lock);
+
+	return result;
+}
+
+/*
+	Map the file twice, one copy after the other, so data can be read
+	and written across the end of the buffer without wrapping.
+	Returns the start of the mapping or MAP_FAILED.
+*/
+static uint8_t *map_mirror(const int fd, const size_t size /* in bytes */)
+{
+	uint8_t *the_data, *address;
+
+	/* Try to map double size memory */
+	the_data = mmap(NULL, size * 2, PROT_NONE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, (off_t)0);
+
+	if (the_data == MAP_FAILED) return MAP_FAILED;
+
+	address = mmap(the_data, size, PROT_READ|PROT_WRITE,
+		MAP_FIXED|MAP_SHARED, fd, (off_t)0);
+	if (address == MAP_FAILED) {
+		munmap(the_data, size * 2);
+		return MAP_FAILED;
+	}
+
+	address = mmap(the_data + size, size, PROT_READ|PROT_WRITE,
+		MAP_FIXED|MAP_SHARED, fd, (off_t)0);
+	if (address == MAP_FAILED) {
+		munmap(the_data, size * 2);
+		return MAP_FAILED;
+	}
+
+	return the_data;
+}
+
+/*
+	The buffer size is taken from the memory budget, it can be smaller than
+	requested_size, down to one page.
+	The backing file is a memfd, so there is no writeback of dirty pages
+	to block the limiter, a temporary file is used only without memfd.
+*/
+static ring_buffer_t *create_ring_buffer(size_t requested_size /* in bytes */,
+	const size_t max_size /* in bytes */)
+{
+	int fd;
+	uint8_t *the_data;
+	ring_buffer_t *the_buffer;
+	char file_name[] = "/tmp/lim-XXXXXX";
+	const size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+
+	requested_size = budget_reserve(requested_size, pagesize, pagesize);
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("limiter", MFD_CLOEXEC);
+#else
+	fd = -1;	/* Not Linux or glibc before 2.27 */
+#endif
+	if (fd < 0) {
+		fd = mkstemp(file_name);
+		if (fd <0) {
+			budget_release(requested_size);
+			return NULL;
+		}
+		/* We keep the descriptor to resize the buffer, the name is not needed anymore */
+		unlink(file_name);
+	}
+
+	if (ftruncate(fd, requested_size) < 0) {
+		budget_release(requested_size);
+		close(fd);
+		return NULL;
+	}
+
+	the_data = map_mirror(fd, requested_size);
+	if (the_data == MAP_FAILED) {
+		budget_release(requested_size);
+		close(fd);
+		return NULL;
+	}
+
+	the_buffer = (ring_buffer_t *) malloc(sizeof(ring_buffer_t));
+	if (the_buffer) {
+		the_buffer->data = (sample_t *)the_data;
+		the_buffer->size = requested_size / sizeof(sample_t);
+		the_buffer->available = 0;
+		the_buffer->processed = 0;
+		the_buffer->position = (sample_t *)the_data;
+		the_buffer->min_size = the_buffer->size;
+		the_buffer->max_size = max(max_size, requested_size) / sizeof(sample_t);
+		the_buffer->fd = fd;
+	} else {
+		budget_release(requested_size);
+		munmap(the_data, requested_size * 2);
+		close(fd);
+	}
+
+	return the_buffer;
+}
+static void delete_ring_buffer(ring_buffer_t *buffer)
+{
+	if (buffer) {
+		budget_release(buffer->size * sizeof(sample_t));
+		munmap(buffer->data, buffer->size * 2 * sizeof(sample_t));
+		close(buffer->fd);
+	}
+	free(buffer);
+}
+/*
+	Move the mirror to a new address range of new_size samples.
+	The first half is moved with mremap, so the pages already in use are kept,
+	the second half is mapped again over the resized file.
+	Without mremap (not Linux) both halves are mapped again, the contents
+	are in the file anyway.
+	Data is not moved, the caller must fix it.
+*/
+static int ring_buffer_remap(ring_buffer_t* const buffer, const size_t new_size)
+{
+	const size_t old_bytes = buffer->size * sizeof(sample_t);
+	const size_t new_bytes = new_size * sizeof(sample_t);
+	uint8_t *the_data;
+#ifdef MREMAP_FIXED
+	uint8_t *address;
+
+	the_data = mmap(NULL, new_bytes * 2, PROT_NONE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, (off_t)0);
+	if (the_data == MAP_FAILED) return -1;
+
+	address = mmap(the_data + new_bytes, new_bytes, PROT_READ|PROT_WRITE,
+		MAP_FIXED|MAP_SHARED, buffer->fd, (off_t)0);
+	if (address == MAP_FAILED) {
+		munmap(the_data, new_bytes * 2);
+		return -1;
+	}
+
+	address = mremap(buffer->data, old_bytes, new_bytes,
+		MREMAP_MAYMOVE|MREMAP_FIXED, the_data);
+	if (address == MAP_FAILED) {
+		munmap(the_data, new_bytes * 2);
+		return -1;
+	}
+
+	/* The first half is gone, release the old second half */
+	munmap((uint8_t *)buffer->data + old_bytes, old_bytes);
+#else
+	if ((the_data = map_mirror(buffer->fd, new_bytes)) == MAP_FAILED) return -1;
+	munmap(buffer->data, old_bytes * 2);
+#endif
+
+	buffer->position = (sample_t *)the_data + (buffer->position - buffer->data);
+	buffer->data = (sample_t *)the_data;
+	buffer->size = new_size;
+
+	return 0;
+}
+/*
+	Grow the buffer so that at least count more samples can be written,
+	as far as the memory budget allows
+	Returns -1 if the buffer is already at its maximum size or remapping fails
+*/
+static int ring_buffer_grow(ring_buffer_t* const buffer, const size_t count)
+{
+	const size_t old_size = buffer->size;
+	const size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	size_t new_size, offset, wrapped, tail, granted;
+
+	if (buffer->available + count <= old_size) return 0;
+	if (old_size >= buffer->max_size) return -1;
+
+	/* Double the size, sizes are page multiples, so the result is a page multiple too */
+	for (new_size = old_size * 2; new_size < buffer->available + count; new_size *= 2);
+	if (new_size > buffer->max_size) new_size = buffer->max_size;
+
+	granted = budget_reserve((new_size - old_size) * sizeof(sample_t), 0, pagesize);
+	if (granted == 0) return -1;
+	new_size = old_size + granted / sizeof(sample_t);
+
+	if (ftruncate(buffer->fd, new_size * sizeof(sample_t)) < 0) {
+		budget_release(granted);
+		return -1;
+	}
+	if (ring_buffer_remap(buffer, new_size) < 0) {
+		budget_release(granted);
+		/* The old mapping is still valid, restore the file size */
+		if (ftruncate(buffer->fd, old_size * sizeof(sample_t)) < 0) return -1;
+		return -1;
+	}
+
+	/* Data that wrapped around the old end must follow the old end again */
+	offset = buffer->position - buffer->data;
+	if (offset + buffer->available > old_size) {
+		wrapped = offset + buffer->available - old_size;
+		tail = old_size - offset;
+		if (wrapped <= tail && wrapped <= new_size - old_size)
+			memcpy(buffer->data + old_size, buffer->data, wrapped * sizeof(sample_t));
+		else {
+			memmove(buffer->data + new_size - tail, buffer->position, tail * sizeof(sample_t));
+			buffer->position = buffer->data + new_size - tail;
+		}
+	}
+
+	return 0;
+}
+/*
+	Halve the buffer if its content fits in the first half without wrapping
+	Returns -1 if the buffer can't be shrunk now
+*/
+static int ring_buffer_shrink(ring_buffer_t* const buffer)
+{
+	const size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	const size_t new_size = (buffer->size * sizeof(sample_t) / 2 / pagesize) * pagesize / sizeof(sample_t);
+	const size_t old_size = buffer->size;
+	const size_t offset = buffer->position - buffer->data;
+
+	if (new_size < buffer->min_size) return -1;
+	if (offset + buffer->available > new_size) return -1;
+
+	if (ring_buffer_remap(buffer, new_size) < 0) return -1;
+	budget_release((old_size - new_size) * sizeof(sample_t));
+	/* Not fatal, the file is only bigger than needed */
+	if (ftruncate(buffer->fd, new_size * sizeof(sample_t)) < 0) return 0;
+
+	return 0;
+}
+/*
+	Convert count samples of input to 32 bit integers, louder floats are clipped
+*/
+static void import_samples(sample_t *destination, const void *input, const size_t count,
+	const limiter_format_t format)
+{
+	const float *floats = (const float *) input;
+	const int16_t *shorts = (const int16_t *) input;
+	const uint8_t *bytes = (const uint8_t *) input;
+	double value;
+	size_t i;
+
+	switch (format) {
+		case LIMITER_FORMAT_S32:
+			memcpy(destination, input, count * sizeof(sample_t));
+			break;
+		case LIMITER_FORMAT_FLOAT:
+			for (i = 0; i < count; ++i) {
+				value = floats[i] * ((double)SAMPLE_MAX + 1);
+				destination[i] = value >= SAMPLE_MAX ? SAMPLE_MAX : value <= SAMPLE_MIN ? SAMPLE_MIN : (sample_t)value;
+			}
+			break;
+		case LIMITER_FORMAT_S16:
+			for (i = 0; i < count; ++i)
+				destination[i] = (sample_t)((uint32_t)(uint16_t)shorts[i] << 16);
+			break;
+		case LIMITER_FORMAT_S24:
+			for (i = 0; i < count; ++i, bytes += 3)
+				destination[i] = (sample_t)((uint32_t)bytes[0] << 8 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 24);
+			break;
+	}
+}
+/*
+	Convert count 32 bit integers to the output format, rounding to the nearest
+*/
+static void export_samples(void *output, const sample_t *source, const size_t count,
+	const limiter_format_t format)
+{
+	float *floats = (float *) output;
+	int16_t *shorts = (int16_t *) output;
+	uint8_t *bytes = (uint8_t *) output;
+	sample_t value;
+	size_t i;
+
+	switch (format) {
+		case LIMITER_FORMAT_S32:
+			memcpy(output, source, count * sizeof(sample_t));
+			break;
+		case LIMITER_FORMAT_FLOAT:
+			for (i = 0; i < count; ++i)
+				floats[i] = source[i] * (1.0f / ((float)SAMPLE_MAX + 1));
+			break;
+		case LIMITER_FORMAT_S16:
+			for (i = 0; i < count; ++i)
+				shorts[i] = source[i] > SAMPLE_MAX - 0x8000 ? INT16_MAX : (source[i] + 0x8000) >> 16;
+			break;
+		case LIMITER_FORMAT_S24:
+			for (i = 0; i < count; ++i, bytes += 3) {
+				value = source[i] > SAMPLE_MAX - 0x80 ? SAMPLE_MAX : source[i] + 0x80;
+				bytes[0] = value >> 8;
+				bytes[1] = value >> 16;
+				bytes[2] = value >> 24;
+			}
+			break;
+	}
+}
+/* Bytes of a sample in format */
+static size_t format_size(const limiter_format_t format)
+{
+	switch (format) {
+		case LIMITER_FORMAT_S16: return 2;
+		case LIMITER_FORMAT_S24: return 3;
+		default: return 4;
+	}
+}
+static int ring_buffer_write(ring_buffer_t* const buffer, const void *input, const size_t count,
+	const limiter_format_t format)
+{
+	sample_t *destination;
+
+	if (count == 0) return 0; /* Nothing to do */
+	if (count > (buffer->size - buffer->available)) return -1;
+
+	destination = buffer->position + buffer->available;
+	if (destination >= buffer->data + buffer->size)
+		destination -= buffer->size;
+	buffer->available += count;
+
+	import_samples(destination, input, count, format);
+
+	return 0;
+}
+/*
+	Return the data pointer if we have count samples to read
+	It doesn't remove the data from the buffer
+*/
+static sample_t *ring_buffer_read(const ring_buffer_t* const buffer, size_t count)
+{
+	if (count > buffer->available) return NULL;
+
+	return buffer->position;
+}
+/*
+	Remove count processed samples from the buffer
+*/
+static int ring_buffer_pop(ring_buffer_t* const buffer, size_t count)
+{
+	if (count > buffer->processed) return -1;
+	buffer->position += count;
+	buffer->available -= count;
+	buffer->processed -= count;
+
+	if (buffer->position >= buffer->data + buffer->size)
+		buffer->position -= buffer->size;
+	return 0;
+}
+/*
+	Mark processed data
+*/
+static int ring_buffer_mark_processed(ring_buffer_t* const buffer, size_t count)
+{
+	if (count > (buffer->available - buffer->processed)) return -1;
+	buffer->processed += count;
+	return 0;
+}
+/*
+	Get free buffer size
+*/
+static size_t ring_buffer_get_free(const ring_buffer_t* const buffer)
+{
+	return buffer->size - buffer->available;
+}
+/*
+	Get start pointer of unprocessed data
+*/
+static sample_t *ring_buffer_get_start_unprocessed(const ring_buffer_t* const buffer)
+{
+	sample_t *result;
+	result = buffer->position + buffer->processed;
+	if(result >= buffer->data + buffer->size) result -= buffer->size;
+	return result;
+}
+/*
+	Get unprocessed buffer size
+*/
+static size_t ring_buffer_get_unprocessed(const ring_buffer_t* const buffer)
+{
+	return buffer->available - buffer->processed;
+}
+/*
+	Fill the whole buffer with processed silence, the fixed latency
+	of limiter_process_fixed()
+*/
+static void fill_silence(ring_buffer_t* const buffer)
+{
+	memset(buffer->data, 0, buffer->size * sizeof(sample_t));
+	buffer->position = buffer->data;
+	buffer->available = buffer->processed = buffer->size;
+}
+
+/*
+	Convert a lookahead time to a buffer size in bytes,
+	rounded up to a multiple of pagesize
+	Returns 0 on error
+*/
+static size_t lookahead_size(const double rate, const float seconds)
+{
+	size_t buffer_size, pagesize, real_size;
+	unsigned int reminder;
+
+	buffer_size = seconds * rate * NUMBER_OF_CHANNELS;
+	if (buffer_size == 0) return 0;
+
+	pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	real_size = buffer_size * sizeof(sample_t);
+
+	/* Check if requested_size is multiple of pagesize and sizeof(sample_t) */
+	if ((reminder = real_size % pagesize))
+		real_size += pagesize - reminder;
+
+	if ((reminder = real_size % (sizeof(sample_t) * NUMBER_OF_CHANNELS) ))
+		return 0;
+
+	return real_size;
+}
+
+/*
+	Sample value of a threshold in dB, 0 dB is computed in float
+	as 2^31, which doesn't fit a sample
+*/
+static sample_t threshold_level(const float threshold_db)
+{
+	const float level = DB_CO(threshold_db) * SAMPLE_MAX;
+
+	return level >= (float)SAMPLE_MAX ? SAMPLE_MAX : (sample_t)level;
+}
+
+/*
+	Lowest and highest values are kept apart and in integers where the format
+	allows, so the loops are simple reductions the compiler can vectorize
+*/
+double limiter_peak(const void *samples, const size_t count, const limiter_format_t format)
+{
+	const int32_t *integers = (const int32_t *) samples;
+	const int16_t *shorts = (const int16_t *) samples;
+	const uint8_t *bytes = (const uint8_t *) samples;
+	const float *floats = (const float *) samples;
+	int32_t low = 0, high = 0, value;
+	float float_low = 0, float_high = 0;
+	size_t i;
+
+	switch (format) {
+		case LIMITER_FORMAT_S32:
+			for (i = 0; i < count; ++i) {
+				low = integers[i] < low ? integers[i] : low;
+				high = integers[i] > high ? integers[i] : high;
+			}
+			return max(-(double)low, (double)high) / ((double)SAMPLE_MAX + 1);
+		case LIMITER_FORMAT_S16:
+			for (i = 0; i < count; ++i) {
+				low = shorts[i] < low ? shorts[i] : low;
+				high = shorts[i] > high ? shorts[i] : high;
+			}
+			return max(-(double)low, (double)high) / 32768;
+		case LIMITER_FORMAT_S24:
+			for (i = 0; i < count; ++i, bytes += 3) {
+				value = (int32_t)((uint32_t)bytes[0] << 8 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 24) >> 8;
+				low = value < low ? value : low;
+				high = value > high ? value : high;
+			}
+			return max(-(double)low, (double)high) / 8388608;
+		case LIMITER_FORMAT_FLOAT:
+			for (i = 0; i < count; ++i) {
+				float_low = floats[i] < float_low ? floats[i] : float_low;
+				float_high = floats[i] > float_high ? floats[i] : float_high;
+			}
+			return max(-(double)float_low, (double)float_high);
+	}
+	return 0;
+}
+
+int limiter_bypass(const float threshold_db, const double peak)
+{
+	if (threshold_db > 0.0f || threshold_db < LIMITER_THRESHOLD_MIN) return 0;
+	/* Floats over full scale are clipped on input, so they change */
+	if (peak > 1.0) return 0;
+	/* The limiter acts on magnitudes over the threshold, SAMPLE_MIN (a peak of 1) counts as SAMPLE_MAX */
+	return min(peak * ((double)SAMPLE_MAX + 1), (double)SAMPLE_MAX) <= threshold_level(threshold_db);
+}
+
+void limiter_config_init(limiter_config_t *config)
+{
+	memset(config, 0, sizeof(limiter_config_t));
+	config->threshold_db = 0.0f;
+	config->rate = 44100;
+	config->channels = NUMBER_OF_CHANNELS;
+	config->format = LIMITER_FORMAT_S32;
+	config->max_lookahead = LIMITER_LOOKAHEAD_DEFAULT;
+}
+
+const char *limiter_config_check(const limiter_config_t *config)
+{
+	/* This limiter works only with 2 channels */
+	if (config->channels != NUMBER_OF_CHANNELS)
+		return "This limiter works only with 2 channels audio";
+	if (config->threshold_db > 0.0f || config->threshold_db < LIMITER_THRESHOLD_MIN)
+		return "threshold cannot be > 0 or < -40";
+	if (config->max_lookahead < LIMITER_LOOKAHEAD_MIN || config->max_lookahead > LIMITER_LOOKAHEAD_MAX)
+		return "max lookahead must be from 0.05 to 60 seconds";
+	if (!(config->rate > 0))
+		return "sample rate must be positive";
+	if (config->format != LIMITER_FORMAT_S32 && config->format != LIMITER_FORMAT_FLOAT
+		&& config->format != LIMITER_FORMAT_S16 && config->format != LIMITER_FORMAT_S24)
+		return "unknown sample format";
+	if (config->meter_name && *config->meter_name != '/')
+		return "meter name must start with /";
+	return NULL;
+}
+
+limiter_t *limiter_create(const limiter_config_t *config)
+{
+	size_t initial_size, max_size;
+	limiter_t *l;
+
+	if (limiter_config_check(config)) return NULL;
+	if (!(l = (limiter_t *) calloc(1, sizeof(limiter_t)))) return NULL;
+
+	l->config = *config;
+	l->threshold = threshold_level(config->threshold_db);
+	l->threshold_db = config->threshold_db;
+	l->max_lookahead = config->max_lookahead;
+	l->stats_file = config->stats_file;
+	l->counters.enabled = config->counters;
+	l->meter_name = config->meter_name;
+	l->channel_stats = config->channel_stats;
+	l->capture_name = config->capture_name;
+
+	l->gain = 1.0f;
+	l->min_gain = 1.0f;
+	channel_stats_reset(&l->input);
+	channel_stats_reset(&l->output);
+
+	/*
+		Allocate the lookahead buffer, small at first, it grows up to max_lookahead.
+		If the memory budget is exhausted we get a smaller buffer and rely on forced slices.
+	*/
+	max_size = lookahead_size(config->rate, l->max_lookahead);
+	initial_size = config->realtime ? max_size
+		: lookahead_size(config->rate, min(LIMITER_LOOKAHEAD_MIN, l->max_lookahead));
+
+	if (initial_size == 0 || max_size == 0 || !(l->rbuffer = create_ring_buffer(initial_size, max_size))) {
+		free(l);
+		return NULL;
+	}
+
+	/*
+		A realtime buffer never shrinks, it never grows past max_size already.
+		It is locked in memory and filled with silence now, so that run()
+		doesn't take page faults
+	*/
+	if (config->realtime) {
+		l->rbuffer->min_size = l->rbuffer->size;
+		if (mlock(l->rbuffer->data, 2 * l->rbuffer->size * sizeof(sample_t)) < 0)
+			message(l, LIMITER_MESSAGE_WARN, "Cannot lock the lookahead buffer in memory");
+		fill_silence(l->rbuffer);
+	}
+	l->stats.max_buffer_size = l->rbuffer->size;
+	counters_open(l, &l->counters);
+	if (l->meter_name) {
+		if ((l->meter = meter_open(l->meter_name))) {
+			l->meter->channels = NUMBER_OF_CHANNELS;
+			l->meter->rate = config->rate;
+			l->control_sequence = l->meter->control_sequence;
+			meter_update(l);
+		} else message(l, LIMITER_MESSAGE_WARN, "Cannot create live meter %s", l->meter_name);
+	}
+	if (l->capture_name && !(l->capture = capture_open(l->capture_name, l)))
+		message(l, LIMITER_MESSAGE_WARN, "Cannot create workload capture %s", l->capture_name);
+
+	return l;
+}
+
+void limiter_reset(limiter_t *l)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+
+	buffer->position = buffer->data;
+	buffer->available = 0;
+	buffer->processed = 0;
+	if (l->config.realtime) fill_silence(buffer);
+	l->gain = 1.0f;
+	l->released = 0;
+	l->scanned = 0;
+}
+
+int limiter_set_threshold(limiter_t *l, float threshold_db)
+{
+	if (threshold_db > 0.0f || threshold_db < LIMITER_THRESHOLD_MIN) return -1;
+	l->threshold_db = threshold_db;
+	l->threshold = threshold_level(threshold_db);
+	return 0;
+}
+
+void limiter_get_stats(const limiter_t *l, limiter_stats_t *stats)
+{
+	stats->threshold_db = l->threshold_db;
+	stats->gain = l->gain;
+	stats->min_gain = l->min_gain;
+	stats->actions = l->actions;
+	stats->slices = l->slices;
+	stats->forced = l->forced;
+	stats->overruns = l->overruns;
+	stats->clipped = l->clipped;
+	stats->buffered = l->rbuffer->available / NUMBER_OF_CHANNELS;
+	stats->size = l->rbuffer->size / NUMBER_OF_CHANNELS;
+}
+
+static const sample_t *find_next_zero_crossing(const sample_t * ibuf, size_t size)
+{
+	size_t i;
+	const sample_t *zero_crossing = NULL;
+	const sample_t *result = NULL;
+#ifdef ZERO_CROSSING_CHECK_OTHER_CHANNELS
+	const sample_t *k = NULL; /* Pointer to check other channel(s) */
+	unsigned short fake = 0;
+#endif
+
+	if (size == 0) return NULL;
+
+	/* size is in samples, the frame after zero_crossing must be in the buffer */
+	for (zero_crossing = ibuf, i = NUMBER_OF_CHANNELS;
+	     i < size; i += NUMBER_OF_CHANNELS, zero_crossing += NUMBER_OF_CHANNELS) {
+		if ((*zero_crossing) <= 0 && (*(zero_crossing + NUMBER_OF_CHANNELS)) > 0) {
+#ifdef ZERO_CROSSING_CHECK_OTHER_CHANNELS
+			fake = 0;
+			for (k = zero_crossing; k < zero_crossing + NUMBER_OF_CHANNELS; ++k) {
+				if (abs(*k) > MAX_ZERO_CROSSING_VALUE) {
+					fake = 1;
+					break;
+				}
+			}
+			if (!fake) {
+#endif
+			result = zero_crossing + NUMBER_OF_CHANNELS;
+			break;
+#ifdef ZERO_CROSSING_CHECK_OTHER_CHANNELS
+			}
+#endif
+		}
+	}
+	return result;
+}
+
+/* Absolute value, SAMPLE_MIN is taken as SAMPLE_MAX */
+static sample_t magnitude(const sample_t value)
+{
+	return value == SAMPLE_MIN ? SAMPLE_MAX : abs(value);
+}
+
+/* Highest magnitude of all channels */
+static sample_t max_magnitude(const channel_stats_t* const stats)
+{
+	sample_t max_value = 0;
+	unsigned int c;
+
+	for (c = 0; c < NUMBER_OF_CHANNELS; ++c)
+		max_value = max(max_value, max(magnitude(stats->min[c]), stats->max[c]));
+	return max_value;
+}
+
+/*
+	Return the highest magnitude from ibuf to end if it is over limit, 0 otherwise
+*/
+static sample_t find_max_overflow(const sample_t * ibuf, const sample_t * end, sample_t limit)
+{
+	const sample_t *overflow = NULL;
+	sample_t current_value = 0, max_value = 0;
+
+	for (overflow = ibuf; overflow < end; ++overflow) {
+		current_value = magnitude(*overflow);
+		if (current_value > limit && current_value > max_value)
+			max_value = current_value;
+	}
+
+	return max_value;
+}
+/*
+	Same as find_max_overflow, the channel statistics of the slice are
+	collected in the same scan and the peak is taken from them
+*/
+static sample_t find_max_overflow_stats(sample_t * ibuf, const sample_t * end, sample_t limit,
+	channel_stats_t* const stats)
+{
+	sample_t max_value;
+
+	channel_stats_reset(stats);
+	channel_stats_scan(stats, ibuf, end, 0, 1.0);
+	max_value = max_magnitude(stats);
+
+	return max_value > limit ? max_value : 0;
+}
+
+/*
+	Multiply samples from begin to end by gain,
+	collecting the statistics of the result in the same loop if stats is not NULL
+*/
+static void apply_gain(sample_t *begin, sample_t *end, const double gain, channel_stats_t* const stats)
+{
+	sample_t *index;
+
+	if (stats) {
+		channel_stats_scan(stats, begin, end, 1, gain);
+		return;
+	}
+	for (index = begin; index < end; ++index)
+		*index = (double)(*index) * gain;
+}
+
+/*
+	Limit the unprocessed data up to end and mark it processed
+*/
+static void process_slice(ring_buffer_t* const buffer, limiter_t* const l, const sample_t *end)
+{
+	sample_t max;
+	channel_stats_t slice_stats;
+	PROFILE_DECLARE;
+
+	++(l->slices);
+	if (l->stats_file)
+		++(l->stats.slice_length[log2_bucket((end - ring_buffer_get_start_unprocessed(buffer)) / NUMBER_OF_CHANNELS)]);
+	PROFILE_START();
+	if (l->channel_stats || l->capture) {
+		max = find_max_overflow_stats(ring_buffer_get_start_unprocessed(buffer), end, l->threshold, &slice_stats);
+		if (l->channel_stats) channel_stats_add(&l->input, &slice_stats);
+		if (l->capture)
+			capture_record(l->capture, LIMITER_CAPTURE_SLICE, 2,
+				(end - ring_buffer_get_start_unprocessed(buffer)) / NUMBER_OF_CHANNELS,
+				max_magnitude(&slice_stats), 0, 0);
+	} else max = find_max_overflow(ring_buffer_get_start_unprocessed(buffer), end, l->threshold);
+	PROFILE_STOP(l, PROFILE_PEAK);
+	/* Peak is 0 if the slice is not limited, gain is threshold / peak */
+	PROBE3(slice, (end - ring_buffer_get_start_unprocessed(buffer)) / NUMBER_OF_CHANNELS,
+		max, l->threshold);
+	if (max) {
+		++(l->actions);
+		l->gain = (double)l->threshold / (double)max;
+		if (l->gain < l->min_gain) l->min_gain = l->gain;
+		if (l->stats_file)
+			++(l->stats.gain_reduction[min((unsigned int)CO_DB(1 / l->gain), REDUCTION_BUCKETS - 1)]);
+		PROFILE_START();
+		apply_gain(ring_buffer_get_start_unprocessed(buffer), (sample_t *)end, l->gain,
+			l->channel_stats ? &l->output : NULL);
+		PROFILE_STOP(l, PROFILE_GAIN);
+	} else {
+		l->gain = 1.0f;
+		/* Output is the same as input */
+		if (l->channel_stats) channel_stats_add(&l->output, &slice_stats);
+	}
+	/* What was searched beyond a forced slice end has still no zero crossing */
+	l->scanned -= min(l->scanned, (size_t)(end - ring_buffer_get_start_unprocessed(buffer)));
+	ring_buffer_mark_processed(buffer, end - ring_buffer_get_start_unprocessed(buffer));
+}
+
+/*
+	Cheap fallback when the work budget is used: clip count samples from the
+	start of the unprocessed data to the threshold and mark them processed
+*/
+static void clip_samples(ring_buffer_t* const buffer, limiter_t* const l, const size_t count)
+{
+	sample_t *begin = ring_buffer_get_start_unprocessed(buffer), *index;
+	const sample_t high = l->threshold, low = -l->threshold;
+
+	if (l->channel_stats) channel_stats_scan(&l->input, begin, begin + count, 0, 1.0);
+	for (index = begin; index < begin + count; ++index)
+		*index = *index > high ? high : *index < low ? low : *index;
+	if (l->channel_stats) channel_stats_scan(&l->output, begin, begin + count, 0, 1.0);
+
+	l->clipped += count / NUMBER_OF_CHANNELS;
+	l->scanned -= min(l->scanned, count);
+	ring_buffer_mark_processed(buffer, count);
+}
+
+/*
+	Slice the unprocessed data at its zero crossings. The search resumes
+	on the last frame searched by the previous call, so every frame is
+	searched once however small the input blocks are. Searching and
+	limiting take from the work budget, a slice that doesn't fit in what
+	is left is found again by the next call, unless it is the first one of
+	the call: every call limits a slice if it finds one. A search goes at
+	least a frame past the last one searched, so even a budget smaller
+	than two frames reaches the end of the buffer.
+*/
+static void process_our_buffer(ring_buffer_t* const buffer, limiter_t* const l)
+{
+	const sample_t *start, *zero_cross;
+	size_t skip, length, end;
+	PROFILE_DECLARE;
+
+	for (;;) {
+		start = ring_buffer_get_start_unprocessed(buffer);
+		skip = l->scanned > NUMBER_OF_CHANNELS ? l->scanned - NUMBER_OF_CHANNELS : 0;
+		length = min(ring_buffer_get_unprocessed(buffer) - skip,
+			max(l->work, l->scanned - skip + NUMBER_OF_CHANNELS));
+		length -= length % NUMBER_OF_CHANNELS;
+		PROFILE_START();
+		zero_cross = find_next_zero_crossing(start + skip, length);
+		PROFILE_STOP(l, PROFILE_CROSSING);
+		if (!zero_cross) {
+			l->scanned = skip + length;
+			l->work -= min(length, l->work);
+			break;
+		}
+		end = zero_cross - start;
+		l->work -= min(end - skip, l->work);
+		if (end > l->work && l->sliced) {
+			/* The next search starts on the crossing */
+			l->scanned = end;
+			l->work = 0;
+			break;
+		}
+		l->work -= min(end, l->work);
+		l->scanned = 0;
+		l->sliced = 1;
+		process_slice(buffer, l, zero_cross);
+	}
+}
+
+/* Give a call its work budget */
+static void work_start(limiter_t* const l)
+{
+	l->work = l->config.work_budget ? l->config.work_budget : SIZE_MAX;
+	l->sliced = 0;
+}
+/* Count the call if it used all of its budget */
+static void work_done(limiter_t* const l)
+{
+	if (l->config.work_budget && l->work == 0) ++(l->overruns);
+}
+
+/*
+	Grow the buffer if count more samples don't fit,
+	it follows the material up to max_lookahead
+*/
+static void make_room(limiter_t* const l, const size_t count, uint64_t *clock)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+
+	if (ring_buffer_get_free(buffer) < count && buffer->size < buffer->max_size) {
+		if (ring_buffer_grow(buffer, count) == 0)
+			message(l, LIMITER_MESSAGE_DEBUG, "Lookahead buffer grown to %lu samples", (unsigned long)buffer->size);
+		l->stats.max_buffer_size = max(l->stats.max_buffer_size, buffer->size);
+		stage_done(l, STAGE_RESIZE, clock);
+	}
+}
+
+/* The buffer is full and has no zero crossing, the search is complete */
+static int buffer_stuck(const limiter_t* const l)
+{
+	const ring_buffer_t *buffer = l->rbuffer;
+
+	return ring_buffer_get_free(buffer) == 0 && buffer->processed == 0
+		&& l->scanned == ring_buffer_get_unprocessed(buffer);
+}
+
+/*
+	Slice the input received so far, then give memory back after
+	a sustained low occupancy and publish the new state
+*/
+static void process_input(limiter_t* const l, uint64_t *clock)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+
+	if (ring_buffer_get_free(buffer) == 0)
+		PROBE2(buffer_full, buffer->size, ring_buffer_get_unprocessed(buffer));
+
+	/* Process our buffer */
+	work_start(l);
+	process_our_buffer(buffer, l);
+
+	/*
+		The buffer is full and has no zero crossing: grow it now, so the
+		lookahead reaches max_lookahead whatever the size of the calls.
+	*/
+	if (buffer_stuck(l)) {
+		stage_done(l, STAGE_PROCESS, clock);
+		make_room(l, NUMBER_OF_CHANNELS, clock);
+	}
+
+	/*
+		The buffer is full, can't grow and has no zero crossing:
+		force a slice, otherwise we couldn't accept more input.
+		If the search was cut by the budget the next call goes on.
+		Like any slice it is limited if it is the first one of the call,
+		it is clipped only after another slice used the budget.
+	*/
+	if (buffer_stuck(l)) {
+		++(l->forced);
+		if (!l->sliced || l->work >= buffer->available)
+			process_slice(buffer, l, ring_buffer_get_start_unprocessed(buffer) + ring_buffer_get_unprocessed(buffer));
+		else clip_samples(buffer, l, buffer->available);
+		l->work -= min(l->work, buffer->available);
+		l->sliced = 1;
+	}
+	work_done(l);
+	stage_done(l, STAGE_PROCESS, clock);
+
+	if (l->stats_file) {
+		++(l->stats.flows);
+		++(l->stats.fill_level[log2_bucket(buffer->available / NUMBER_OF_CHANNELS)]);
+	}
+
+	if (buffer->available > l->fill_peak) l->fill_peak = buffer->available;
+	if (++(l->flows) >= SHRINK_WINDOW) {
+		if (l->fill_peak < buffer->size / 4 && ring_buffer_shrink(buffer) == 0)
+			message(l, LIMITER_MESSAGE_DEBUG, "Lookahead buffer shrunk to %lu samples", (unsigned long)buffer->size);
+		l->fill_peak = 0;
+		l->flows = 0;
+		stage_done(l, STAGE_RESIZE, clock);
+	}
+
+	if (l->meter) meter_update(l);
+}
+
+/*
+	Limit the data left after the last input with the current gain
+*/
+static void process_tail(limiter_t* const l, uint64_t *clock)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	sample_t *index;
+	channel_stats_t tail_stats;
+	PROFILE_DECLARE;
+
+	/* Process our buffer, all of it */
+	l->work = SIZE_MAX;
+	process_our_buffer(buffer, l);
+
+	/* Process remaining data using current gain */
+	if (ring_buffer_get_unprocessed(buffer) > 0) {
+		index = ring_buffer_get_start_unprocessed(buffer);
+		if (l->channel_stats || l->capture) {
+			channel_stats_reset(&tail_stats);
+			channel_stats_scan(&tail_stats, index, index + ring_buffer_get_unprocessed(buffer), 0, 1.0);
+			if (l->channel_stats) channel_stats_add(&l->input, &tail_stats);
+			/* The tail is the last slice */
+			if (l->capture)
+				capture_record(l->capture, LIMITER_CAPTURE_SLICE, 2,
+					ring_buffer_get_unprocessed(buffer) / NUMBER_OF_CHANNELS, max_magnitude(&tail_stats), 0, 0);
+		}
+		PROFILE_START();
+		apply_gain(index, index + ring_buffer_get_unprocessed(buffer), l->gain,
+			l->channel_stats ? &l->output : NULL);
+		PROFILE_STOP(l, PROFILE_GAIN);
+		ring_buffer_mark_processed(buffer, ring_buffer_get_unprocessed(buffer));
+		l->scanned = 0;
+	}
+	stage_done(l, STAGE_PROCESS, clock);
+}
+
+int limiter_process(limiter_t *l, const void *in, size_t *in_frames, void *out, size_t *out_frames)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	size_t idone, odone;
+	const size_t ioffered = *in_frames * NUMBER_OF_CHANNELS, ooffered = *out_frames * NUMBER_OF_CHANNELS;
+	uint64_t clock = l->stats_file ? now_ns() : 0;
+	PROFILE_DECLARE;
+
+	idone = odone = 0;
+	counters_enable(&l->counters, 1);
+	PROBE3(flow_entry, ioffered, ooffered, buffer->available);
+
+	/* A new threshold applies from the next slice, processed data is not touched */
+	if (l->meter) meter_control(l);
+
+	/* Copy processed buffer to output */
+	if (buffer->processed > 0) {
+		odone = min(buffer->processed, ooffered);
+		if (odone > 0) {
+			PROFILE_START();
+			export_samples(out, ring_buffer_read(buffer, odone), odone, l->config.format);
+			PROFILE_STOP(l, PROFILE_COPY_OUT);
+			ring_buffer_pop(buffer, odone);
+		}
+	}
+	*out_frames = odone / NUMBER_OF_CHANNELS;
+	stage_done(l, STAGE_COPY_OUT, &clock);
+
+	/*
+		Take only what fits: the buffer grows when it is full without a zero
+		crossing, so its size follows the material, not the calls. That is
+		done by process_input(), here only for a buffer restored full.
+	*/
+	if (buffer_stuck(l)) make_room(l, NUMBER_OF_CHANNELS, &clock);
+	idone = min(ring_buffer_get_free(buffer), ioffered);
+	PROFILE_START();
+	if (ring_buffer_write(buffer, in, idone, l->config.format) == -1) {
+		counters_enable(&l->counters, 0);
+		return -1;
+	}
+	PROFILE_STOP(l, PROFILE_COPY_IN);
+	*in_frames = idone / NUMBER_OF_CHANNELS;
+	stage_done(l, STAGE_COPY_IN, &clock);
+
+	process_input(l, &clock);
+
+	/* Emit what was just processed if the output has room, rather than on the next call */
+	if (buffer->processed > 0 && odone < ooffered) {
+		size_t more = min(buffer->processed, ooffered - odone);
+
+		PROFILE_START();
+		export_samples((char *) out + odone * format_size(l->config.format),
+			ring_buffer_read(buffer, more), more, l->config.format);
+		PROFILE_STOP(l, PROFILE_COPY_OUT);
+		ring_buffer_pop(buffer, more);
+		odone += more;
+		*out_frames = odone / NUMBER_OF_CHANNELS;
+		stage_done(l, STAGE_COPY_OUT, &clock);
+	}
+
+	if (l->capture) capture_record(l->capture, LIMITER_CAPTURE_FLOW, 4, ioffered, ooffered, idone, odone);
+
+	l->counters.samples += idone;
+	counters_enable(&l->counters, 0);
+	PROBE3(flow_exit, idone, odone, buffer->available);
+
+	return 0;
+}
+
+int limiter_flush(limiter_t *l, void *out, size_t *out_frames)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	size_t odone;
+	const size_t ooffered = *out_frames * NUMBER_OF_CHANNELS;
+	uint64_t clock = l->stats_file ? now_ns() : 0;
+	PROFILE_DECLARE;
+
+	odone = 0;
+	++(l->stats.drains);
+	counters_enable(&l->counters, 1);
+	PROBE2(drain_entry, ooffered, buffer->available);
+
+	process_tail(l, &clock);
+
+	/* Copy processed buffer to output */
+	if (buffer->processed > 0) {
+		odone = min(buffer->processed, ooffered);
+		PROFILE_START();
+		if (odone > 0) export_samples(out, ring_buffer_read(buffer, odone), odone, l->config.format);
+		PROFILE_STOP(l, PROFILE_COPY_OUT);
+		ring_buffer_pop(buffer, odone);
+	}
+	*out_frames = odone / NUMBER_OF_CHANNELS;
+	stage_done(l, STAGE_COPY_OUT, &clock);
+
+	if (l->meter) meter_update(l);
+	if (l->capture) capture_record(l->capture, LIMITER_CAPTURE_DRAIN, 2, ooffered, odone, 0, 0);
+
+	l->counters.samples += odone;
+	counters_enable(&l->counters, 0);
+	PROBE2(drain_exit, odone, buffer->available);
+
+	return 0;
+}
+
+int limiter_process_fixed(limiter_t *l, const void *in, void *out, size_t frames)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	const size_t bytes = format_size(l->config.format);
+	const uint8_t *input = (const uint8_t *) in;
+	uint8_t *output = (uint8_t *) out;
+	size_t count, due, done = 0;
+	uint64_t clock = l->stats_file ? now_ns() : 0;
+
+	if (!l->config.realtime) return -1;
+	work_start(l);
+	counters_enable(&l->counters, 1);
+	PROBE3(flow_entry, frames * NUMBER_OF_CHANNELS, frames * NUMBER_OF_CHANNELS, buffer->available);
+
+	if (l->meter) meter_control(l);
+
+	while (frames > 0) {
+		count = min(frames * NUMBER_OF_CHANNELS, buffer->size);
+		/* The oldest count samples are due now, cut their slice if it is still open */
+		if (buffer->processed < count) {
+			due = count - buffer->processed;
+			++(l->forced);
+			if (l->work >= due) {
+				process_slice(buffer, l, ring_buffer_get_start_unprocessed(buffer) + due);
+				l->work -= due;
+				l->sliced = 1;
+			} else {
+				clip_samples(buffer, l, due);
+				l->work = 0;
+			}
+		}
+		export_samples(output, ring_buffer_read(buffer, count), count, l->config.format);
+		ring_buffer_pop(buffer, count);
+		ring_buffer_write(buffer, input, count, l->config.format);
+		process_our_buffer(buffer, l);
+
+		input += count * bytes;
+		output += count * bytes;
+		frames -= count / NUMBER_OF_CHANNELS;
+		done += count;
+	}
+	work_done(l);
+	stage_done(l, STAGE_PROCESS, &clock);
+
+	if (l->stats_file) {
+		++(l->stats.flows);
+		++(l->stats.fill_level[log2_bucket(buffer->available / NUMBER_OF_CHANNELS)]);
+	}
+	if (l->meter) meter_update(l);
+
+	l->counters.samples += done;
+	counters_enable(&l->counters, 0);
+	PROBE3(flow_exit, done, done, buffer->available);
+
+	return 0;
+}
+
+size_t limiter_latency(const limiter_t *l)
+{
+	return l->rbuffer->size / NUMBER_OF_CHANNELS;
+}
+
+void *limiter_input_region(limiter_t *l, size_t *frames)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	uint64_t clock = l->stats_file ? now_ns() : 0;
+	sample_t *destination;
+
+	if (l->config.format != LIMITER_FORMAT_S32) return NULL;
+
+	make_room(l, *frames * NUMBER_OF_CHANNELS, &clock);
+
+	destination = buffer->position + buffer->available;
+	if (destination >= buffer->data + buffer->size)
+		destination -= buffer->size;
+	*frames = ring_buffer_get_free(buffer) / NUMBER_OF_CHANNELS;
+	return destination;
+}
+
+int limiter_input_commit(limiter_t *l, size_t frames)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	const size_t count = frames * NUMBER_OF_CHANNELS;
+	uint64_t clock = l->stats_file ? now_ns() : 0;
+
+	if (count > ring_buffer_get_free(buffer)) return -1;
+
+	counters_enable(&l->counters, 1);
+	PROBE3(flow_entry, count, l->released, buffer->available);
+
+	/* A new threshold applies from the next slice, processed data is not touched */
+	if (l->meter) meter_control(l);
+
+	buffer->available += count;
+	process_input(l, &clock);
+
+	/* Recorded as a limiter_process() call producing what was released since the last one */
+	if (l->capture) capture_record(l->capture, LIMITER_CAPTURE_FLOW, 4, count, l->released, count, l->released);
+
+	l->counters.samples += count;
+	counters_enable(&l->counters, 0);
+	PROBE3(flow_exit, count, l->released, buffer->available);
+	l->released = 0;
+
+	return 0;
+}
+
+const void *limiter_output_region(const limiter_t *l, size_t *frames)
+{
+	*frames = l->rbuffer->processed / NUMBER_OF_CHANNELS;
+	return l->rbuffer->position;
+}
+
+int limiter_output_release(limiter_t *l, size_t frames)
+{
+	if (ring_buffer_pop(l->rbuffer, frames * NUMBER_OF_CHANNELS) < 0) return -1;
+	l->released += frames * NUMBER_OF_CHANNELS;
+	return 0;
+}
+
+void limiter_finish(limiter_t *l)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	uint64_t clock = l->stats_file ? now_ns() : 0;
+
+	++(l->stats.drains);
+	PROBE2(drain_entry, buffer->available, buffer->available);
+	process_tail(l, &clock);
+	if (l->meter) meter_update(l);
+	/* Recorded as a single limiter_flush() call producing everything */
+	if (l->capture) capture_record(l->capture, LIMITER_CAPTURE_DRAIN, 2, buffer->available, buffer->available, 0, 0);
+	PROBE2(drain_exit, buffer->available, buffer->available);
+}
+
+static void report_channel_stats(const limiter_t* const l, const char *name, const channel_stats_t* const stats)
+{
+	unsigned int c;
+	double peak, rms;
+
+	if (stats->frames == 0) return;
+	for (c = 0; c < NUMBER_OF_CHANNELS; ++c) {
+		peak = (double)max(magnitude(stats->min[c]), stats->max[c]) / SAMPLE_MAX;
+		rms = sqrt(stats->sum_squares[c] / stats->frames) / SAMPLE_MAX;
+		message(l, LIMITER_MESSAGE_REPORT, "Channel %u %s: peak %.2f dBFS, RMS %.2f dBFS, DC %.6f, clips %" PRIu64,
+			c + 1, name, peak > 0 ? CO_DB(peak) : -INFINITY, rms > 0 ? CO_DB(rms) : -INFINITY,
+			stats->sum[c] / stats->frames / SAMPLE_MAX, stats->clips[c]);
+	}
+}
+static void write_channel_stats(FILE *f, const char *name, const channel_stats_t* const stats)
+{
+	unsigned int c;
+	const double frames = max(stats->frames, 1);
+
+	fprintf(f, "  \"%s\": [", name);
+	for (c = 0; c < NUMBER_OF_CHANNELS; ++c)
+		fprintf(f, "%s{\"peak\": %.9f, \"rms\": %.9f, \"dc\": %.9f, \"clips\": %" PRIu64 "}", c ? ", " : "",
+			(double)max(magnitude(stats->min[c]), stats->max[c]) / SAMPLE_MAX,
+			sqrt(stats->sum_squares[c] / frames) / SAMPLE_MAX,
+			stats->sum[c] / frames / SAMPLE_MAX, stats->clips[c]);
+	fprintf(f, "],\n");
+}
+static void write_histogram(FILE *f, const char *name, const uint64_t *histogram, const unsigned int buckets)
+{
+	unsigned int i;
+
+	fprintf(f, "  \"%s\": [", name);
+	for (i = 0; i < buckets; ++i)
+		fprintf(f, "%s%" PRIu64, i ? ", " : "", histogram[i]);
+	fprintf(f, "],\n");
+}
+/*
+	Write the statistics as JSON, histograms are arrays of counts,
+	bucket bounds are described in statistics_t
+*/
+static int write_statistics(const limiter_t* const l, const char *file_name,
+	const uint64_t counter_values[COUNTERS])
+{
+	FILE *f;
+	unsigned int i;
+
+	if (!(f = fopen(file_name, "w"))) return -1;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"threshold_db\": %.2f,\n", l->threshold_db);
+	fprintf(f, "  \"rate\": %.0f,\n", l->config.rate);
+	fprintf(f, "  \"channels\": %u,\n", NUMBER_OF_CHANNELS);
+	fprintf(f, "  \"max_lookahead_s\": %.3f,\n", l->max_lookahead);
+	fprintf(f, "  \"max_buffer_frames\": %lu,\n", (unsigned long)(l->stats.max_buffer_size / NUMBER_OF_CHANNELS));
+	fprintf(f, "  \"flows\": %" PRIu64 ",\n", l->stats.flows);
+	fprintf(f, "  \"drains\": %" PRIu64 ",\n", l->stats.drains);
+	fprintf(f, "  \"slices\": %" PRIu64 ",\n", l->slices);
+	fprintf(f, "  \"actions\": %" PRIu64 ",\n", l->actions);
+	fprintf(f, "  \"forced\": %" PRIu64 ",\n", l->forced);
+	fprintf(f, "  \"overruns\": %" PRIu64 ",\n", l->overruns);
+	fprintf(f, "  \"clipped\": %" PRIu64 ",\n", l->clipped);
+	fprintf(f, "  \"min_gain\": %.6f,\n", l->min_gain);
+	if (l->channel_stats) {
+		write_channel_stats(f, "input_channels", &l->input);
+		write_channel_stats(f, "output_channels", &l->output);
+	}
+	write_histogram(f, "slice_length_log2_frames", l->stats.slice_length, LENGTH_BUCKETS);
+	write_histogram(f, "gain_reduction_db", l->stats.gain_reduction, REDUCTION_BUCKETS);
+	write_histogram(f, "fill_level_log2_frames", l->stats.fill_level, LENGTH_BUCKETS);
+	fprintf(f, "  \"time_ns\": {");
+	for (i = 0; i < STAGES; ++i)
+		fprintf(f, "%s\"%s\": %" PRIu64, i ? ", " : "", stage_names[i], l->stats.time[i]);
+	fprintf(f, "}");
+	if (counter_values) {
+		fprintf(f, ",\n  \"hw_counters\": {\"samples\": %" PRIu64, l->counters.samples);
+		for (i = 0; i < COUNTERS; ++i)
+			fprintf(f, ", \"%s\": %" PRIu64, counter_names[i], counter_values[i]);
+		fprintf(f, "}");
+	}
+#ifdef LIMITER_PROFILE
+	fprintf(f, ",\n  \"profile_" PROFILE_UNIT "\": {");
+	for (i = 0; i < PROFILES; ++i)
+		fprintf(f, "%s\"%s\": [%" PRIu64 ", %" PRIu64 "]", i ? ", " : "",
+			profile_names[i], l->profile_calls[i], l->profile_cycles[i]);
+	fprintf(f, "}");
+#endif
+	fprintf(f, "\n}\n");
+
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+void limiter_report(limiter_t *l)
+{
+	double gain_reduction = 0.0f;
+	uint64_t counter_values[COUNTERS];
+	double samples;
+#ifdef LIMITER_PROFILE
+	unsigned int i;
+#endif
+
+	message(l, LIMITER_MESSAGE_REPORT, "We have lowered gain %" PRIu64 " times", l->actions);
+	message(l, LIMITER_MESSAGE_REPORT, "We have sliced %" PRIu64 " times", l->slices);
+	if (l->forced) message(l, LIMITER_MESSAGE_REPORT, "We have forced %" PRIu64 " slices on a full buffer", l->forced);
+	if (l->overruns)
+		message(l, LIMITER_MESSAGE_REPORT, "The work budget was used in %" PRIu64 " calls, %" PRIu64 " frames clipped",
+			l->overruns, l->clipped);
+	if (l->min_gain > 0.0f) gain_reduction = CO_DB(1 / l->min_gain);
+	message(l, LIMITER_MESSAGE_REPORT, "Max gain reduction: %.1f dB", gain_reduction);
+	if (l->channel_stats) {
+		report_channel_stats(l, "input", &l->input);
+		report_channel_stats(l, "output", &l->output);
+	}
+#ifdef LIMITER_PROFILE
+	for (i = 0; i < PROFILES; ++i)
+		message(l, LIMITER_MESSAGE_REPORT, "Profile %s: %" PRIu64 " calls, %" PRIu64 " " PROFILE_UNIT ", %.0f per call",
+			profile_names[i], l->profile_calls[i], l->profile_cycles[i],
+			l->profile_calls[i] ? (double)l->profile_cycles[i] / l->profile_calls[i] : 0.0);
+#endif
+
+	if (counters_read(&l->counters, counter_values) && l->counters.samples > 0) {
+		samples = l->counters.samples;
+		message(l, LIMITER_MESSAGE_REPORT, "Cycles per sample: %.2f", counter_values[COUNTER_CYCLES] / samples);
+		if (counter_values[COUNTER_CYCLES] > 0)
+			message(l, LIMITER_MESSAGE_REPORT, "Instructions per cycle: %.2f",
+				(double)counter_values[COUNTER_INSTRUCTIONS] / counter_values[COUNTER_CYCLES]);
+		message(l, LIMITER_MESSAGE_REPORT, "LLC misses per 1000 samples: %.3f",
+			counter_values[COUNTER_LLC_MISSES] * 1000 / samples);
+		message(l, LIMITER_MESSAGE_REPORT, "dTLB misses per 1000 samples: %.3f",
+			counter_values[COUNTER_DTLB_MISSES] * 1000 / samples);
+	}
+}
+
+/* Read an unsigned LEB128 number, returns -1 at the end of the file */
+static int read_number(FILE *f, uint64_t *value)
+{
+	int byte;
+	unsigned int shift = 0;
+
+	*value = 0;
+	do {
+		if ((byte = getc(f)) == EOF || shift > 63) return -1;
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return 0;
+}
+
+int limiter_checkpoint(const limiter_t *l, const char *file_name, uint64_t position)
+{
+	const ring_buffer_t *buffer = l->rbuffer;
+	const double values[3] = {l->threshold_db, l->gain, l->min_gain};
+	char *temporary;
+	FILE *f;
+	int result = -1;
+
+	/* The fixed latency buffer is never empty, see limiter.h */
+	if (l->config.realtime || !(temporary = malloc(strlen(file_name) + 5))) return -1;
+	strcpy(temporary, file_name);
+	strcat(temporary, ".tmp");
+	if (!(f = fopen(temporary, "wb"))) {
+		free(temporary);
+		return -1;
+	}
+
+	fputs(LIMITER_CHECKPOINT_MAGIC, f);
+	capture_number(f, LIMITER_CHECKPOINT_VERSION);
+	capture_number(f, l->config.rate);
+	capture_number(f, NUMBER_OF_CHANNELS);
+	capture_number(f, l->config.format);
+	capture_number(f, l->max_lookahead * 1000 + 0.5f);
+	capture_number(f, position);
+	capture_number(f, l->actions);
+	capture_number(f, l->slices);
+	capture_number(f, l->forced);
+	capture_number(f, l->overruns);
+	capture_number(f, l->clipped);
+	capture_number(f, buffer->available);
+	capture_number(f, buffer->processed);
+	capture_number(f, l->scanned);
+	fwrite(values, sizeof(double), 3, f);
+	fwrite(&l->input, sizeof(channel_stats_t), 1, f);
+	fwrite(&l->output, sizeof(channel_stats_t), 1, f);
+	fwrite(&l->stats, sizeof(statistics_t), 1, f);
+	/* The mirror makes the contents contiguous */
+	fwrite(buffer->position, sizeof(sample_t), buffer->available, f);
+
+	if (fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0) result = 0;
+	if (fclose(f) != 0) result = -1;
+	if (result == 0 && rename(temporary, file_name) < 0) result = -1;
+	if (result < 0) unlink(temporary);
+	free(temporary);
+
+	return result;
+}
+
+int limiter_restore(limiter_t *l, const char *file_name, uint64_t *position)
+{
+	ring_buffer_t *buffer = l->rbuffer;
+	char magic[sizeof(LIMITER_CHECKPOINT_MAGIC) - 1];
+	uint64_t header[6], actions, slices, forced, overruns, clipped, available, processed, scanned;
+	double values[3];
+	channel_stats_t input, output;
+	statistics_t stats;
+	FILE *f;
+	unsigned int i;
+	int result = -1;
+
+	if (l->config.realtime || buffer->available > 0 || !(f = fopen(file_name, "rb"))) return -1;
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, LIMITER_CHECKPOINT_MAGIC, sizeof(magic)))
+		goto out;
+	for (i = 0; i < 6; ++i)
+		if (read_number(f, &header[i]) < 0) goto out;
+	if (header[0] != LIMITER_CHECKPOINT_VERSION || header[1] != (uint64_t)l->config.rate
+		|| header[2] != NUMBER_OF_CHANNELS || header[3] != (uint64_t)l->config.format
+		|| header[4] != (uint64_t)(l->max_lookahead * 1000 + 0.5f)) {
+		message(l, LIMITER_MESSAGE_WARN, "Checkpoint %s has another configuration", file_name);
+		goto out;
+	}
+	if (read_number(f, &actions) < 0 || read_number(f, &slices) < 0 || read_number(f, &forced) < 0
+		|| read_number(f, &overruns) < 0 || read_number(f, &clipped) < 0
+		|| read_number(f, &available) < 0 || read_number(f, &processed) < 0 || read_number(f, &scanned) < 0
+		|| fread(values, sizeof(double), 3, f) != 3 || fread(&input, sizeof(input), 1, f) != 1
+		|| fread(&output, sizeof(output), 1, f) != 1 || fread(&stats, sizeof(stats), 1, f) != 1)
+		goto out;
+	if (processed > available || scanned > available - processed || available % NUMBER_OF_CHANNELS
+		|| available > buffer->max_size || values[0] > 0.0 || values[0] < LIMITER_THRESHOLD_MIN)
+		goto out;
+
+	/*
+		Start from the beginning of the buffer, grown as needed: its size
+		doesn't change the output, slices are forced only at max_size.
+		The memory budget can grant less than asked, then it doesn't fit
+	*/
+	buffer->position = buffer->data;
+	if (ring_buffer_grow(buffer, available) < 0 || available > buffer->size) goto out;
+	if (fread(buffer->data, sizeof(sample_t), available, f) != available) goto out;
+
+	buffer->available = available;
+	buffer->processed = processed;
+	l->scanned = scanned;
+	limiter_set_threshold(l, values[0]);
+	l->gain = values[1];
+	l->min_gain = values[2];
+	l->actions = actions;
+	l->slices = slices;
+	l->forced = forced;
+	l->overruns = overruns;
+	l->clipped = clipped;
+	l->input = input;
+	l->output = output;
+	l->stats = stats;
+	l->stats.max_buffer_size = max(l->stats.max_buffer_size, buffer->size);
+	*position = header[5];
+	result = 0;
+
+out:
+	fclose(f);
+	return result;
+}
+
+void limiter_destroy(limiter_t *l)
+{
+	uint64_t counter_values[COUNTERS];
+	int have_counters;
+
+	if (!l) return;
+
+	delete_ring_buffer(l->rbuffer);
+	meter_close(l->meter, l->meter_name);
+	if (l->capture) {
+		putc(LIMITER_CAPTURE_END, l->capture);
+		if (fclose(l->capture) != 0) message(l, LIMITER_MESSAGE_WARN, "Cannot write workload capture %s", l->capture_name);
+	}
+	have_counters = counters_read(&l->counters, counter_values);
+	counters_close(&l->counters);
+
+	if (l->stats_file && write_statistics(l, l->stats_file, have_counters ? counter_values : NULL) < 0)
+		message(l, LIMITER_MESSAGE_WARN, "Cannot write statistics to %s", l->stats_file);
+
+	free(l);
+}